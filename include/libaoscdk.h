@@ -9,6 +9,37 @@
 #ifndef LIBAOSCDK_H
 #define LIBAOSCDK_H
 
+#include <stddef.h>
 
+/**
+ * Set the memory budget shared by the log queue, the I/O buffers, and the file
+ * write-behind queues. When it is exhausted, producers wait for memory to be
+ * released.
+ *
+ * @param budget [in] The budget in bytes, or 0 for no limit (the default).
+ * @return Non-0 if the operation succeed.
+ */
+int dk_mem_set_budget(size_t budget);
+
+/**
+ * Log the peak memory usage, warning if the peak RSS exceeds the budget. This
+ * is meant to be called at the end of an installation, before logging is
+ * deinitialized.
+ */
+void dk_mem_report(void);
+
+/**
+ * Initialize the logging module.
+ *
+ * @return Non-0 if the operation succeed.
+ */
+int dk_log_init(void);
+
+/**
+ * Deinitialize the logging module.
+ *
+ * @return Non-0 if the operation succeed.
+ */
+int dk_log_deinit(void);
 
 #endif
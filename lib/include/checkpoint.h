@@ -0,0 +1,128 @@
+/**
+ * @file checkpoint.h
+ * @author Junde Yhi <lmy441900@aosc.xyz>
+ * @copyright (C) 2019-2020 Anthon Open Source Community
+ *
+ * Definition of the checkpoint journal, with which an interrupted installation
+ * can be resumed.
+ */
+
+#ifndef LIBAOSCDK_CHECKPOINT_H
+#define LIBAOSCDK_CHECKPOINT_H
+
+#include <writer.h>
+#include <glib.h>
+
+/**
+ * Name of the checkpoint journal, relative to the root of the target.
+ */
+#define DK_CHECKPOINT_FILE_NAME ".aoscdk-checkpoint"
+
+/**
+ * Default minimal interval, in microseconds, between two writes of the
+ * extraction progress.
+ */
+#define DK_CHECKPOINT_INTERVAL (10 * G_USEC_PER_SEC)
+
+/**
+ * An opaque checkpoint journal.
+ */
+struct DkCheckpoint;
+
+/**
+ * Open the checkpoint journal on the target.
+ *
+ * If a journal exists and was written for the same DKIR, the installation can
+ * be resumed from it. Otherwise (including when the journal is unreadable) an
+ * empty journal is started.
+ *
+ * @param root [in] Path to the mounted root of the target.
+ * @param ir   [in] The DKIR in use, identifying the installation.
+ * @return A #DkCheckpoint.
+ */
+struct DkCheckpoint *dk_checkpoint_open(const char *root, const char *ir);
+
+/**
+ * Check whether a step has been completed.
+ *
+ * @param cp   [in] A #DkCheckpoint.
+ * @param step [in] Name of the step.
+ * @return Non-0 if the step has been completed.
+ */
+int dk_checkpoint_step_is_done(const struct DkCheckpoint *cp, const char *step);
+
+/**
+ * Record that a step has been completed, and write the journal to disk.
+ *
+ * The target file system is flushed first. Any #DkWriter used by the step must
+ * have been flushed before, since files still queued in it are not on disk.
+ *
+ * @param cp   [in] A #DkCheckpoint.
+ * @param step [in] Name of the step.
+ * @return Non-0 if the operation succeed, or 0 if the target cannot be synced
+ *         or the journal written.
+ */
+int dk_checkpoint_step_done(struct DkCheckpoint *cp, const char *step);
+
+/**
+ * Get the progress of an interrupted extraction.
+ *
+ * @param cp        [in]  A #DkCheckpoint.
+ * @param offset    [out] Offset in the archive after the last completed file.
+ * @param last_file [out] Path to the last completed file. Free it with
+ *                        g_free().
+ * @return Non-0 if there is a recorded progress, or 0 if the extraction should
+ *         start from the beginning.
+ */
+int dk_checkpoint_get_extract(const struct DkCheckpoint *cp, guint64 *offset, char **last_file);
+
+/**
+ * Record the progress of the extraction.
+ *
+ * This is meant to be called after every extracted file. The journal is only
+ * written once per interval (see dk_checkpoint_set_interval()), after `writer`
+ * is flushed
+ * and the target file system is synced, so that files before `offset` are
+ * really on disk.
+ *
+ * Files queued in a #DkWriter are not on disk until it is flushed, so the
+ * writer holding the files before `offset` must be passed here. Any other
+ * writer holding such files must be flushed by the caller beforehand.
+ *
+ * @param cp        [in] A #DkCheckpoint.
+ * @param writer    [in] The #DkWriter the files are written with, or `NULL` if
+ *                       they are written directly.
+ * @param offset    [in] Offset in the archive after the last completed file.
+ * @param last_file [in] Path to the last completed file.
+ * @return Non-0 if the operation succeed, or 0 if the writer cannot be
+ *         flushed, or the target cannot be synced or the journal written; in
+ *         which case nothing is recorded.
+ */
+int dk_checkpoint_set_extract(struct DkCheckpoint *cp, struct DkWriter *writer, guint64 offset, const char *last_file);
+
+/**
+ * Set the minimal interval between two writes of the extraction progress, e.g.
+ * for testing.
+ *
+ * @param cp       [in] A #DkCheckpoint.
+ * @param interval [in] The interval in microseconds. #DK_CHECKPOINT_INTERVAL is
+ *                      used by default; 0 writes the progress every time.
+ */
+void dk_checkpoint_set_interval(struct DkCheckpoint *cp, gint64 interval);
+
+/**
+ * Remove the journal from the target, after the installation has completed.
+ *
+ * @param cp [in] A #DkCheckpoint.
+ * @return Non-0 if the operation succeed.
+ */
+int dk_checkpoint_finish(struct DkCheckpoint *cp);
+
+/**
+ * Free a #DkCheckpoint. The journal on disk is left untouched.
+ *
+ * @param cp [in] A #DkCheckpoint.
+ */
+void dk_checkpoint_free(struct DkCheckpoint *cp);
+
+#endif
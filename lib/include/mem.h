@@ -0,0 +1,99 @@
+/**
+ * @file mem.h
+ * @author Junde Yhi <lmy441900@aosc.xyz>
+ * @copyright (C) 2019-2020 Anthon Open Source Community
+ *
+ * Definition of the memory budget shared by the buffers and queues of
+ * libaoscdk.
+ */
+
+#ifndef LIBAOSCDK_MEM_H
+#define LIBAOSCDK_MEM_H
+
+#include <stddef.h>
+
+/**
+ * Users of the memory budget.
+ *
+ * Memory is accounted per pool so that a waiter only waits for memory of its
+ * own kind, which is guaranteed to be released by someone else. A request is
+ * always granted if nothing is held in its pool, even if the budget is
+ * exceeded, so that no pool can be starved by another one.
+ */
+enum DkMemPool {
+  DK_MEM_POOL_LOG,   ///< Messages in the log queue.
+  DK_MEM_POOL_IO,    ///< Stream buffers, e.g. for decompression or images.
+  DK_MEM_POOL_WRITE, ///< Files queued in a #DkWriter.
+  DK_MEM_POOL_MAX,   ///< Number of pools.
+};
+
+/**
+ * Set the memory budget.
+ *
+ * @param budget [in] The budget in bytes, or 0 for no limit (the default).
+ * @return Non-0 if the operation succeed.
+ */
+int dk_mem_set_budget(size_t budget);
+
+/**
+ * Get the memory budget.
+ *
+ * @return The budget in bytes, or 0 if there is no limit.
+ */
+size_t dk_mem_get_budget(void);
+
+/**
+ * Take memory from the budget, waiting for other threads to release memory in
+ * the same pool if the budget is exhausted.
+ *
+ * A thread must not wait while it holds memory of the same pool that only it
+ * can release. Try dk_mem_try_acquire() and release what is held on failure.
+ *
+ * @param pool [in] The pool the memory is taken for.
+ * @param size [in] Number of bytes.
+ */
+void dk_mem_acquire(enum DkMemPool pool, size_t size);
+
+/**
+ * Take memory from the budget without waiting.
+ *
+ * @param pool [in] The pool the memory is taken for.
+ * @param size [in] Number of bytes.
+ * @return Non-0 if the memory is taken.
+ */
+int dk_mem_try_acquire(enum DkMemPool pool, size_t size);
+
+/**
+ * Take memory from the budget regardless of the limit.
+ *
+ * This is for threads that must never wait, e.g. the log worker, which drains
+ * the log queue.
+ *
+ * @param pool [in] The pool the memory is taken for.
+ * @param size [in] Number of bytes.
+ */
+void dk_mem_force_acquire(enum DkMemPool pool, size_t size);
+
+/**
+ * Give memory taken by dk_mem_acquire() and the like back to the budget.
+ *
+ * @param pool [in] The pool the memory was taken for.
+ * @param size [in] Number of bytes.
+ */
+void dk_mem_release(enum DkMemPool pool, size_t size);
+
+/**
+ * Get the peak resident set size of the process.
+ *
+ * @return The peak RSS in bytes, or 0 if it cannot be read.
+ */
+size_t dk_mem_get_peak_rss(void);
+
+/**
+ * Log the peak memory usage, warning if the peak RSS exceeds the budget. This
+ * is meant to be called at the end of an installation, before logging is
+ * deinitialized.
+ */
+void dk_mem_report(void);
+
+#endif
@@ -0,0 +1,49 @@
+/**
+ * @file progress.h
+ * @author Junde Yhi <lmy441900@aosc.xyz>
+ * @copyright (C) 2019-2020 Anthon Open Source Community
+ *
+ * Definition of the progress counters of the current installation step.
+ */
+
+#ifndef LIBAOSCDK_PROGRESS_H
+#define LIBAOSCDK_PROGRESS_H
+
+#include <glib.h>
+
+/**
+ * Reset the counters when a step starts.
+ *
+ * Must not race with dk_progress_add().
+ *
+ * @param bytes_total [in] Number of bytes the step will process, or 0 if
+ *                         unknown.
+ * @param items_total [in] Number of items (e.g. files) the step will process,
+ *                         or 0 if unknown.
+ */
+void dk_progress_reset(guint64 bytes_total, guint64 items_total);
+
+/**
+ * Account processed bytes and items to the current step.
+ *
+ * This is meant to be called from hot loops of any thread. Each thread updates
+ * its own cache line with relaxed atomics, so no lock is taken and threads do
+ * not contend with each other.
+ *
+ * @param bytes [in] Number of bytes processed since the last call.
+ * @param items [in] Number of items processed since the last call.
+ */
+void dk_progress_add(guint64 bytes, guint64 items);
+
+/**
+ * Take a sample of the counters, and build the parameters of the
+ * `dk.step.progress` notification.
+ *
+ * The throughput is smoothed between samples, so this should be called at a
+ * steady rate (e.g. every second) by a single thread.
+ *
+ * @return A floating `a{sv}` #GVariant. See docs/dkrpc-specs.md for its keys.
+ */
+GVariant *dk_progress_sample(void);
+
+#endif
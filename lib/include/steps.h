@@ -0,0 +1,58 @@
+/**
+ * @file steps.h
+ * @author Junde Yhi <lmy441900@aosc.xyz>
+ * @copyright (C) 2019-2020 Anthon Open Source Community
+ *
+ * Definition of the installation steps performed by libaoscdk.
+ */
+
+#ifndef LIBAOSCDK_STEPS_H
+#define LIBAOSCDK_STEPS_H
+
+/**
+ * Ways to deploy the system onto the target partition.
+ */
+enum DkDeployMode {
+  DK_DEPLOY_MODE_EXTRACT, ///< Extract a tarball file by file (the default).
+  DK_DEPLOY_MODE_IMAGE,   ///< Write a prebuilt filesystem image block by block.
+};
+
+/**
+ * Convert the value of the DKIR property `deploy.mode` to a #DkDeployMode.
+ *
+ * Accepted values are `"extract"` and `"image"`. A `NULL` value selects
+ * #DK_DEPLOY_MODE_EXTRACT.
+ *
+ * @param mode [in]  The value of `deploy.mode`, or `NULL`.
+ * @param out  [out] The corresponding #DkDeployMode.
+ * @return Non-0 if the operation succeed, or 0 if `mode` is not recognized.
+ */
+int dk_deploy_mode_parse(const char *mode, enum DkDeployMode *out);
+
+/**
+ * Write a prebuilt filesystem image onto the target partition.
+ *
+ * The image is streamed in large chunks through an aligned buffer, and the
+ * target is opened with `O_DIRECT` to bypass the page cache (the file system
+ * holding the target may not support it, e.g. tmpfs, in which case buffered
+ * I/O is used). Holes in the image and chunks consisting of zeroes only are
+ * not written; the corresponding ranges of the target are zeroed with
+ * `BLKZEROOUT` or by punching holes instead, unless the target is known to
+ * read as zeroes there.
+ *
+ * After the image is written, the file system is grown to fill the target if
+ * `fs_type` is one of the ext2/3/4 family. Other file systems are left as-is.
+ *
+ * `image` must be a regular file. `target` may be a block device, which must
+ * not be smaller than the image, or a regular file (e.g. the backing file of a
+ * loop device), which is extended to the size of the image if smaller.
+ *
+ * @param image   [in] Path to the file system image.
+ * @param target  [in] Path to the target partition.
+ * @param fs_type [in] Type of the file system in the image, e.g. `"ext4"`, or
+ *                     `NULL` to skip growing.
+ * @return Non-0 if the operation succeed.
+ */
+int dk_step_image_deploy(const char *image, const char *target, const char *fs_type);
+
+#endif
@@ -0,0 +1,91 @@
+/**
+ * @file writer.h
+ * @author Junde Yhi <lmy441900@aosc.xyz>
+ * @copyright (C) 2019-2020 Anthon Open Source Community
+ *
+ * Definition of the batching file writer used by the extract and packages
+ * steps to create many small files.
+ */
+
+#ifndef LIBAOSCDK_WRITER_H
+#define LIBAOSCDK_WRITER_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * Backends with which a #DkWriter creates files.
+ */
+enum DkWriterBackend {
+  DK_WRITER_BACKEND_SYNC,     ///< Blocking `openat`/`write`/`fchmod`/`close`.
+  DK_WRITER_BACKEND_IO_URING, ///< Batched submissions through io_uring.
+};
+
+/**
+ * An opaque file writer.
+ *
+ * A #DkWriter is not thread-safe. Each thread writing files should own one.
+ */
+struct DkWriter;
+
+/**
+ * Create a #DkWriter.
+ *
+ * The io_uring backend is used if libaoscdk is built with liburing and the
+ * running kernel supports it; otherwise the synchronous backend is used.
+ *
+ * @return A new #DkWriter.
+ */
+struct DkWriter *dk_writer_new(void);
+
+/**
+ * Create a #DkWriter with a specific backend, e.g. for benchmarking.
+ *
+ * @param backend [in] The #DkWriterBackend to use.
+ * @return A new #DkWriter, or `NULL` if the backend is not supported.
+ */
+struct DkWriter *dk_writer_new_with_backend(enum DkWriterBackend backend);
+
+/**
+ * Get the backend used by a #DkWriter.
+ *
+ * @param writer [in] A #DkWriter.
+ * @return The #DkWriterBackend in use.
+ */
+enum DkWriterBackend dk_writer_get_backend(const struct DkWriter *writer);
+
+/**
+ * Queue a regular file to be written.
+ *
+ * The file is created (or truncated) and filled with `data` no later than the
+ * next dk_writer_flush(), which happens automatically when enough files are
+ * queued, or when the memory budget (#DK_MEM_POOL_WRITE) is exhausted. `data`
+ * is copied; `dirfd` must be kept open until then.
+ *
+ * @param writer [in] A #DkWriter.
+ * @param dirfd  [in] The directory `path` is relative to, or `AT_FDCWD`.
+ * @param path   [in] Path to the file.
+ * @param data   [in] Content of the file.
+ * @param len    [in] Length of `data`.
+ * @param mode   [in] Permission bits of the file, applied regardless of umask.
+ * @return Non-0 if the operation succeed, or 0 if an automatic flush fails.
+ */
+int dk_writer_add(struct DkWriter *writer, int dirfd, const char *path, const void *data, size_t len, mode_t mode);
+
+/**
+ * Write all queued files.
+ *
+ * @param writer [in] A #DkWriter.
+ * @return Non-0 if all files are written successfully.
+ */
+int dk_writer_flush(struct DkWriter *writer);
+
+/**
+ * Free a #DkWriter. Files still queued are discarded; call dk_writer_flush()
+ * first.
+ *
+ * @param writer [in] A #DkWriter.
+ */
+void dk_writer_free(struct DkWriter *writer);
+
+#endif
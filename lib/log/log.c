@@ -9,6 +9,7 @@
 #include "config.h"
 #include "msg.h"
 #include <log.h>
+#include <mem.h>
 
 /**
  * Defines the logging domain for g_log functions, which should be the name of
@@ -35,6 +36,9 @@ static GThread *log_worker_thread_g = NULL;
 
 /**
  * Asynchronous queue for log messages.
+ *
+ * Messages in the queue take memory from #DK_MEM_POOL_LOG, so producers are
+ * slowed down by the memory budget if the worker cannot keep up.
  */
 static GAsyncQueue *log_queue_g = NULL;
 
@@ -296,12 +300,17 @@ void dk_log(enum DkLogLevel level, const char *file, const int line, const char
   va_list args;
   va_start(args, fmt);
 
-  g_async_queue_push(
-    log_queue_g,
-    dk_log_msg_new_v(level, file, line, func, fmt, args)
-  );
+  struct DkLogMsg *msg = dk_log_msg_new_v(level, file, line, func, fmt, args);
 
   va_end(args);
+
+  // The worker drains the queue, so it must never wait for it
+  if (g_thread_self() == log_worker_thread_g)
+    dk_mem_force_acquire(DK_MEM_POOL_LOG, msg->size);
+  else
+    dk_mem_acquire(DK_MEM_POOL_LOG, msg->size);
+
+  g_async_queue_push(log_queue_g, msg);
 }
 
 int dk_log_set_output_file(const char *path)
@@ -10,8 +10,10 @@
 
 #include "msg.h"
 #include <log.h>
+#include <mem.h>
 #include <glib.h>
 #include <stdbool.h>
+#include <string.h>
 
 struct DkLogMsg *dk_log_msg_new(const enum DkLogLevel level, const char *file, const unsigned int line, const char *func, const char *log)
 {
@@ -23,6 +25,7 @@ struct DkLogMsg *dk_log_msg_new(const enum DkLogLevel level, const char *file, c
   msg->line  = line;
   msg->func  = g_strdup(func);
   msg->log   = g_strdup(log);
+  msg->size  = sizeof(struct DkLogMsg) + strlen(file) + strlen(func) + strlen(log) + 3;
 
   return msg;
 }
@@ -46,12 +49,16 @@ struct DkLogMsg *dk_log_msg_new_worker_exit(void)
 
 void dk_log_msg_free(struct DkLogMsg *msg)
 {
+  if (msg->size)
+    dk_mem_release(DK_MEM_POOL_LOG, msg->size);
+
   msg->worker_exit = false;
   msg->level = DK_LOG_LEVEL_FATAL; // XXX
   g_clear_pointer(&msg->file, g_free);
   msg->line = 0;
   g_clear_pointer(&msg->func, g_free);
   g_clear_pointer(&msg->log, g_free);
+  msg->size = 0;
 
   g_free(msg);
 }
@@ -14,6 +14,7 @@
 #include <log.h>
 #include <stdbool.h>
 #include <stdarg.h>
+#include <stddef.h>
 
 /**
  * Type of the message going through #log_queue_g.
@@ -25,6 +26,7 @@ struct DkLogMsg {
   unsigned int line;     ///< The number of line where the log is sent.
   char *func;            ///< The name of function where the log is sent.
   char *log;             ///< The log message.
+  size_t size;           ///< Bytes taken from the memory budget for this message.
 };
 
 /**
@@ -35,7 +37,8 @@ struct DkLogMsg {
  * @param line  [in] The number of line where the log is sent.
  * @param func  [in] The name of function where the log is sent.
  * @param msg   [in] The log message.
- * @return A #DkLogMsg with the corresponding fields initialized.
+ * @return A #DkLogMsg with the corresponding fields initialized. Its
+ *         DkLogMsg::size is computed, but not taken from the memory budget.
  */
 struct DkLogMsg *dk_log_msg_new(const enum DkLogLevel level, const char *file, const unsigned int line, const char *func, const char *msg);
 
@@ -63,7 +66,8 @@ struct DkLogMsg *dk_log_msg_new_v(const enum DkLogLevel level, const char *file,
 struct DkLogMsg *dk_log_msg_new_worker_exit(void);
 
 /**
- * Free the memory occupied by a #DkLogMsg.
+ * Free the memory occupied by a #DkLogMsg, and give DkLogMsg::size back to the
+ * memory budget.
  *
  * @param msg [in] A #DkLogMsg.
  */
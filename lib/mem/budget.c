@@ -0,0 +1,255 @@
+/**
+ * @file budget.c
+ * @author Junde Yhi <lmy441900@aosc.xyz>
+ * @copyright (C) 2019-2020 Anthon Open Source Community
+ *
+ * Implementation of the memory budget shared by the buffers and queues of
+ * libaoscdk.
+ *
+ * Note that taking and releasing memory must not log, since the log queue
+ * itself takes memory from the budget.
+ */
+
+#include <mem.h>
+#include <log.h>
+#include <glib.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+
+/**
+ * The budget in bytes, or 0 for no limit.
+ *
+ * Without a limit, taking and releasing memory only updates the counters
+ * below, and no lock is taken.
+ */
+static atomic_size_t mem_budget_g;
+
+/**
+ * Bytes held in each pool.
+ */
+static atomic_size_t mem_used_g[DK_MEM_POOL_MAX];
+
+/**
+ * Bytes held in all pools.
+ */
+static atomic_size_t mem_used_total_g;
+
+/**
+ * The maximum of #mem_used_total_g ever reached.
+ */
+static atomic_size_t mem_used_peak_g;
+
+/**
+ * Number of threads waiting for memory in each pool.
+ *
+ * Releasing memory only takes #mem_lock_g if someone is waiting in the pool.
+ */
+static atomic_uint mem_waiters_g[DK_MEM_POOL_MAX];
+
+/**
+ * Protects the waits on #mem_released_g.
+ */
+static GMutex mem_lock_g;
+
+/**
+ * Signalled when memory is released in each pool.
+ */
+static GCond mem_released_g[DK_MEM_POOL_MAX];
+
+/********** Private APIs **********/
+
+/**
+ * Raise #mem_used_peak_g to `total` if it is lower.
+ *
+ * @param total [in] Bytes held in all pools.
+ */
+static void dk_mem_update_peak(const size_t total)
+{
+  size_t peak = atomic_load_explicit(&mem_used_peak_g, memory_order_relaxed);
+
+  while (peak < total
+         && !atomic_compare_exchange_weak_explicit(&mem_used_peak_g, &peak, total, memory_order_relaxed, memory_order_relaxed))
+    ;
+}
+
+/**
+ * Wake a thread waiting for memory in a pool, if any.
+ *
+ * @param pool [in] The pool memory has been given back to.
+ */
+static void dk_mem_wake(const enum DkMemPool pool)
+{
+  if (atomic_load(&mem_waiters_g[pool]) == 0)
+    return;
+
+  g_mutex_lock(&mem_lock_g);
+  g_cond_signal(&mem_released_g[pool]);
+  g_mutex_unlock(&mem_lock_g);
+}
+
+/**
+ * Account a request if it can be granted.
+ *
+ * A request is granted if there is no budget, if it fits in the budget, or if
+ * nothing is held in the pool (so that waiting would not be guaranteed to end).
+ *
+ * With a budget, the pool is reserved first, so that only one request at a
+ * time can find it empty, and the total only grows if the request fits.
+ *
+ * @param pool   [in] The pool the memory is taken for.
+ * @param size   [in] Number of bytes.
+ * @param force  [in] Grant the request regardless of the budget.
+ * @param locked [in] #mem_lock_g is held by the caller.
+ * @return `TRUE` if the request is granted.
+ */
+static gboolean dk_mem_take(const enum DkMemPool pool, const size_t size, const gboolean force, const gboolean locked)
+{
+  size_t budget = atomic_load(&mem_budget_g);
+  size_t total;
+
+  if (budget == 0 || force) {
+    atomic_fetch_add(&mem_used_g[pool], size);
+    total = atomic_fetch_add(&mem_used_total_g, size) + size;
+    dk_mem_update_peak(total);
+    return TRUE;
+  }
+
+  size_t used = atomic_load(&mem_used_g[pool]);
+
+  do {
+    if (used != 0 && atomic_load(&mem_used_total_g) + size > budget)
+      return FALSE;
+  } while (!atomic_compare_exchange_weak(&mem_used_g[pool], &used, used + size));
+
+  total = atomic_load(&mem_used_total_g);
+
+  do {
+    if (used != 0 && total + size > budget) {
+      // Someone else took the room meanwhile. A waiter may have found the pool
+      // not empty because of the reservation, so wake it up; none can have
+      // checked while #mem_lock_g is held here
+      atomic_fetch_sub(&mem_used_g[pool], size);
+      if (!locked)
+        dk_mem_wake(pool);
+      return FALSE;
+    }
+  } while (!atomic_compare_exchange_weak(&mem_used_total_g, &total, total + size));
+
+  dk_mem_update_peak(total + size);
+
+  return TRUE;
+}
+
+/********** Public APIs **********/
+
+int dk_mem_set_budget(size_t budget)
+{
+  atomic_store(&mem_budget_g, budget);
+
+  // A larger budget may satisfy waiters of any pool
+  g_mutex_lock(&mem_lock_g);
+  for (int i = 0; i < DK_MEM_POOL_MAX; i++)
+    g_cond_broadcast(&mem_released_g[i]);
+  g_mutex_unlock(&mem_lock_g);
+
+  return 1;
+}
+
+size_t dk_mem_get_budget(void)
+{
+  return atomic_load(&mem_budget_g);
+}
+
+void dk_mem_acquire(enum DkMemPool pool, size_t size)
+{
+  g_return_if_fail(pool < DK_MEM_POOL_MAX);
+
+  if (dk_mem_take(pool, size, FALSE, FALSE))
+    return;
+
+  g_mutex_lock(&mem_lock_g);
+
+  // Announce the wait before checking again, so that a release either is seen
+  // by the check, or sees the waiter and signals it after it sleeps
+  atomic_fetch_add(&mem_waiters_g[pool], 1);
+
+  while (!dk_mem_take(pool, size, FALSE, TRUE))
+    g_cond_wait(&mem_released_g[pool], &mem_lock_g);
+
+  // What is left may satisfy the next waiter
+  if (atomic_fetch_sub(&mem_waiters_g[pool], 1) > 1)
+    g_cond_signal(&mem_released_g[pool]);
+
+  g_mutex_unlock(&mem_lock_g);
+}
+
+int dk_mem_try_acquire(enum DkMemPool pool, size_t size)
+{
+  g_return_val_if_fail(pool < DK_MEM_POOL_MAX, 0);
+
+  return dk_mem_take(pool, size, FALSE, FALSE);
+}
+
+void dk_mem_force_acquire(enum DkMemPool pool, size_t size)
+{
+  g_return_if_fail(pool < DK_MEM_POOL_MAX);
+
+  dk_mem_take(pool, size, TRUE, FALSE);
+}
+
+void dk_mem_release(enum DkMemPool pool, size_t size)
+{
+  g_return_if_fail(pool < DK_MEM_POOL_MAX);
+
+  size_t used = atomic_load(&mem_used_g[pool]);
+
+  do {
+    g_warn_if_fail(used >= size);
+    size = MIN(size, used);
+  } while (!atomic_compare_exchange_weak(&mem_used_g[pool], &used, used - size));
+
+  atomic_fetch_sub(&mem_used_total_g, size);
+
+  dk_mem_wake(pool);
+}
+
+size_t dk_mem_get_peak_rss(void)
+{
+  char *status = NULL;
+  size_t rss = 0;
+
+  if (!g_file_get_contents("/proc/self/status", &status, NULL, NULL))
+    return 0;
+
+  const char *hwm = strstr(status, "VmHWM:");
+  if (hwm) {
+    unsigned long kib = 0;
+    if (sscanf(hwm, "VmHWM: %lu kB", &kib) == 1)
+      rss = (size_t)kib * 1024;
+  }
+
+  g_free(status);
+  return rss;
+}
+
+void dk_mem_report(void)
+{
+  size_t budget = dk_mem_get_budget();
+  size_t rss = dk_mem_get_peak_rss();
+
+  size_t peak = atomic_load(&mem_used_peak_g);
+
+  char *rss_str = g_format_size(rss);
+  char *peak_str = g_format_size(peak);
+  char *budget_str = budget ? g_format_size(budget) : g_strdup("unlimited");
+
+  dk_info("Peak RSS: %s; peak buffered: %s; budget: %s", rss_str, peak_str, budget_str);
+
+  if (budget && rss > budget)
+    dk_warning("Peak RSS (%s) exceeded the memory budget (%s)", rss_str, budget_str);
+
+  g_free(rss_str);
+  g_free(peak_str);
+  g_free(budget_str);
+}
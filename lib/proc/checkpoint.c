@@ -0,0 +1,237 @@
+/**
+ * @file checkpoint.c
+ * @author Junde Yhi <lmy441900@aosc.xyz>
+ * @copyright (C) 2019-2020 Anthon Open Source Community
+ *
+ * Implementation of the checkpoint journal, with which an interrupted
+ * installation can be resumed.
+ *
+ * The journal is a key file on the target:
+ *
+ * ```ini
+ * [checkpoint]
+ * ir=<SHA-256 of the DKIR>
+ *
+ * [steps]
+ * partition=true
+ *
+ * [extract]
+ * offset=1048576
+ * last-file=usr/bin/bash
+ * ```
+ */
+
+#define _GNU_SOURCE // syncfs
+
+#include <checkpoint.h>
+#include <log.h>
+#include <writer.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+struct DkCheckpoint {
+  char *root;           ///< Path to the mounted root of the target.
+  char *path;           ///< Path to the journal.
+  GKeyFile *journal;    ///< Content of the journal.
+  gint64 last_save;     ///< Monotonic time of the last write of the extraction progress.
+  gint64 interval;      ///< Minimal interval between two writes of the extraction progress.
+};
+
+/********** Private APIs **********/
+
+/**
+ * Write the journal to disk.
+ *
+ * g_key_file_save_to_file() writes to a temporary file and renames it over the
+ * journal, so an interruption leaves either the old or the new journal.
+ *
+ * @param cp [in] A #DkCheckpoint.
+ * @return Non-0 if the operation succeed.
+ */
+static int dk_checkpoint_save(struct DkCheckpoint *cp)
+{
+  GError *error = NULL;
+
+  if (!g_key_file_save_to_file(cp->journal, cp->path, &error)) {
+    dk_warning("Failed to write the checkpoint journal %s: %s", cp->path, error->message);
+    g_clear_error(&error);
+    return 0;
+  }
+
+  return 1;
+}
+
+/**
+ * Flush the file system of the target.
+ *
+ * @param cp [in] A #DkCheckpoint.
+ * @return Non-0 if the operation succeed.
+ */
+static int dk_checkpoint_sync_target(struct DkCheckpoint *cp)
+{
+  int fd = open(cp->root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    dk_warning("Failed to open %s: %s", cp->root, g_strerror(errno));
+    return 0;
+  }
+
+  int r = syncfs(fd);
+  if (r < 0)
+    dk_warning("Failed to sync %s: %s", cp->root, g_strerror(errno));
+
+  close(fd);
+  return r == 0;
+}
+
+/********** Public APIs **********/
+
+struct DkCheckpoint *dk_checkpoint_open(const char *root, const char *ir)
+{
+  g_return_val_if_fail(root, NULL);
+  g_return_val_if_fail(ir, NULL);
+
+  struct DkCheckpoint *cp = g_malloc0(sizeof(struct DkCheckpoint));
+  char *digest = g_compute_checksum_for_string(G_CHECKSUM_SHA256, ir, -1);
+  GError *error = NULL;
+
+  cp->root = g_strdup(root);
+  cp->path = g_build_filename(root, DK_CHECKPOINT_FILE_NAME, NULL);
+  cp->journal = g_key_file_new();
+  cp->last_save = g_get_monotonic_time();
+  cp->interval = DK_CHECKPOINT_INTERVAL;
+
+  if (g_key_file_load_from_file(cp->journal, cp->path, G_KEY_FILE_NONE, &error)) {
+    char *journal_digest = g_key_file_get_string(cp->journal, "checkpoint", "ir", NULL);
+
+    if (g_strcmp0(digest, journal_digest) == 0) {
+      dk_info("Resuming from the checkpoint journal %s", cp->path);
+    } else {
+      dk_info("The checkpoint journal %s belongs to another DKIR, starting over", cp->path);
+      g_key_file_free(cp->journal);
+      cp->journal = g_key_file_new();
+    }
+
+    g_free(journal_digest);
+  } else {
+    if (!g_error_matches(error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+      dk_warning("Failed to read the checkpoint journal %s: %s. Starting over.", cp->path, error->message);
+
+    g_clear_error(&error);
+    g_key_file_free(cp->journal);
+    cp->journal = g_key_file_new();
+  }
+
+  g_key_file_set_string(cp->journal, "checkpoint", "ir", digest);
+  g_free(digest);
+
+  return cp;
+}
+
+int dk_checkpoint_step_is_done(const struct DkCheckpoint *cp, const char *step)
+{
+  g_return_val_if_fail(cp, 0);
+  g_return_val_if_fail(step, 0);
+
+  return g_key_file_get_boolean(cp->journal, "steps", step, NULL);
+}
+
+int dk_checkpoint_step_done(struct DkCheckpoint *cp, const char *step)
+{
+  g_return_val_if_fail(cp, 0);
+  g_return_val_if_fail(step, 0);
+
+  dk_debug("Checkpoint: step %s done", step);
+
+  // Whatever the step did must be on disk before it is claimed to be done
+  if (!dk_checkpoint_sync_target(cp))
+    return 0;
+
+  g_key_file_set_boolean(cp->journal, "steps", step, TRUE);
+
+  return dk_checkpoint_save(cp);
+}
+
+int dk_checkpoint_get_extract(const struct DkCheckpoint *cp, guint64 *offset, char **last_file)
+{
+  g_return_val_if_fail(cp, 0);
+  g_return_val_if_fail(offset, 0);
+  g_return_val_if_fail(last_file, 0);
+
+  GError *error = NULL;
+
+  guint64 r = g_key_file_get_uint64(cp->journal, "extract", "offset", &error);
+  if (error) {
+    g_clear_error(&error);
+    return 0;
+  }
+
+  *offset = r;
+  *last_file = g_key_file_get_string(cp->journal, "extract", "last-file", NULL);
+
+  return 1;
+}
+
+int dk_checkpoint_set_extract(struct DkCheckpoint *cp, struct DkWriter *writer, guint64 offset, const char *last_file)
+{
+  g_return_val_if_fail(cp, 0);
+  g_return_val_if_fail(last_file, 0);
+
+  gint64 now = g_get_monotonic_time();
+  if (now - cp->last_save < cp->interval)
+    return 1;
+
+  // Files before the offset must be on disk before the offset is recorded:
+  // first written out of the writer, then flushed out of the page cache
+  if (writer && !dk_writer_flush(writer))
+    return 0;
+
+  if (!dk_checkpoint_sync_target(cp))
+    return 0;
+
+  g_key_file_set_uint64(cp->journal, "extract", "offset", offset);
+  g_key_file_set_string(cp->journal, "extract", "last-file", last_file);
+
+  if (!dk_checkpoint_save(cp))
+    return 0;
+
+  // Only a recorded offset holds off the next one; a failure is retried at the
+  // next call
+  cp->last_save = now;
+  return 1;
+}
+
+void dk_checkpoint_set_interval(struct DkCheckpoint *cp, gint64 interval)
+{
+  g_return_if_fail(cp);
+  g_return_if_fail(interval >= 0);
+
+  cp->interval = interval;
+}
+
+int dk_checkpoint_finish(struct DkCheckpoint *cp)
+{
+  g_return_val_if_fail(cp, 0);
+
+  dk_debug("Removing the checkpoint journal %s", cp->path);
+
+  if (g_remove(cp->path) < 0 && errno != ENOENT) {
+    dk_warning("Failed to remove the checkpoint journal %s: %s", cp->path, g_strerror(errno));
+    return 0;
+  }
+
+  return 1;
+}
+
+void dk_checkpoint_free(struct DkCheckpoint *cp)
+{
+  g_return_if_fail(cp);
+
+  g_clear_pointer(&cp->root, g_free);
+  g_clear_pointer(&cp->path, g_free);
+  g_clear_pointer(&cp->journal, g_key_file_free);
+
+  g_free(cp);
+}
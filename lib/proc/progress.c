@@ -0,0 +1,198 @@
+/**
+ * @file progress.c
+ * @author Junde Yhi <lmy441900@aosc.xyz>
+ * @copyright (C) 2019-2020 Anthon Open Source Community
+ *
+ * Implementation of the progress counters of the current installation step.
+ */
+
+#include <progress.h>
+#include <glib.h>
+#include <stdatomic.h>
+
+/**
+ * Number of counter shards. Threads are spread over them round-robin.
+ */
+#define DK_PROGRESS_SHARDS 16
+
+/**
+ * Time constant, in microseconds, of the exponential smoothing applied to the
+ * throughput.
+ */
+#define DK_PROGRESS_SMOOTHING (5 * G_USEC_PER_SEC)
+
+/**
+ * A set of counters updated by some of the threads.
+ *
+ * Each shard takes a whole cache line, so that threads updating different
+ * shards never bounce the same line between CPUs.
+ */
+struct DkProgressShard {
+  _Alignas(64) atomic_uint_fast64_t bytes; ///< Bytes processed.
+  atomic_uint_fast64_t items;              ///< Items processed.
+};
+
+/**
+ * The counter shards.
+ */
+static struct DkProgressShard progress_shards_g[DK_PROGRESS_SHARDS];
+
+/**
+ * The next shard to be assigned to a thread.
+ */
+static atomic_uint progress_next_shard_g;
+
+/**
+ * The shard assigned to the current thread, or -1 if not yet assigned.
+ */
+static _Thread_local int progress_shard_t = -1;
+
+/**
+ * Protects the totals and the sampling state below.
+ */
+static GMutex progress_lock_g;
+
+static guint64 progress_bytes_total_g = 0; ///< Bytes to process, or 0 if unknown.
+static guint64 progress_items_total_g = 0; ///< Items to process, or 0 if unknown.
+static gint64 progress_last_time_g = 0;    ///< Monotonic time of the last sample.
+static guint64 progress_last_bytes_g = 0;  ///< Bytes processed at the last sample.
+static guint64 progress_last_items_g = 0;  ///< Items processed at the last sample.
+static double progress_bytes_rate_g = 0;   ///< Smoothed bytes per second.
+static double progress_items_rate_g = 0;   ///< Smoothed items per second.
+
+/********** Private APIs **********/
+
+/**
+ * Sum the counters of all shards.
+ *
+ * @param bytes [out] Bytes processed.
+ * @param items [out] Items processed.
+ */
+static void dk_progress_sum(guint64 *bytes, guint64 *items)
+{
+  *bytes = 0;
+  *items = 0;
+
+  for (int i = 0; i < DK_PROGRESS_SHARDS; i++) {
+    *bytes += atomic_load_explicit(&progress_shards_g[i].bytes, memory_order_relaxed);
+    *items += atomic_load_explicit(&progress_shards_g[i].items, memory_order_relaxed);
+  }
+}
+
+/**
+ * Estimate the remaining time.
+ *
+ * @param done  [in] Amount processed.
+ * @param total [in] Amount to process, or 0 if unknown.
+ * @param rate  [in] Amount processed per second.
+ * @return Remaining seconds, or -1 if it cannot be estimated.
+ */
+static gint64 dk_progress_eta(const guint64 done, const guint64 total, const double rate)
+{
+  if (total == 0 || rate <= 0)
+    return -1;
+
+  if (done >= total)
+    return 0;
+
+  return (gint64)((total - done) / rate);
+}
+
+/********** Public APIs **********/
+
+void dk_progress_reset(guint64 bytes_total, guint64 items_total)
+{
+  g_mutex_lock(&progress_lock_g);
+
+  for (int i = 0; i < DK_PROGRESS_SHARDS; i++) {
+    atomic_store_explicit(&progress_shards_g[i].bytes, 0, memory_order_relaxed);
+    atomic_store_explicit(&progress_shards_g[i].items, 0, memory_order_relaxed);
+  }
+
+  progress_bytes_total_g = bytes_total;
+  progress_items_total_g = items_total;
+  progress_last_time_g = g_get_monotonic_time();
+  progress_last_bytes_g = 0;
+  progress_last_items_g = 0;
+  progress_bytes_rate_g = 0;
+  progress_items_rate_g = 0;
+
+  g_mutex_unlock(&progress_lock_g);
+}
+
+void dk_progress_add(guint64 bytes, guint64 items)
+{
+  if (G_UNLIKELY(progress_shard_t < 0))
+    progress_shard_t = atomic_fetch_add_explicit(&progress_next_shard_g, 1, memory_order_relaxed) % DK_PROGRESS_SHARDS;
+
+  struct DkProgressShard *shard = &progress_shards_g[progress_shard_t];
+
+  atomic_fetch_add_explicit(&shard->bytes, bytes, memory_order_relaxed);
+  atomic_fetch_add_explicit(&shard->items, items, memory_order_relaxed);
+}
+
+GVariant *dk_progress_sample(void)
+{
+  GVariantBuilder builder;
+  guint64 bytes = 0, items = 0;
+
+  g_mutex_lock(&progress_lock_g);
+
+  dk_progress_sum(&bytes, &items);
+
+  gint64 now = g_get_monotonic_time();
+  gint64 dt = now - progress_last_time_g;
+
+  if (dt > 0) {
+    double bytes_rate = (double)(bytes - progress_last_bytes_g) * G_USEC_PER_SEC / dt;
+    double items_rate = (double)(items - progress_last_items_g) * G_USEC_PER_SEC / dt;
+
+    // Exponential moving average; the weight of the new sample grows with the
+    // time it covers
+    double alpha = (double)dt / (DK_PROGRESS_SMOOTHING + dt);
+    if (progress_last_bytes_g == 0 && progress_last_items_g == 0)
+      alpha = 1; // Nothing to smooth with yet
+
+    progress_bytes_rate_g += alpha * (bytes_rate - progress_bytes_rate_g);
+    progress_items_rate_g += alpha * (items_rate - progress_items_rate_g);
+
+    progress_last_time_g = now;
+    progress_last_bytes_g = bytes;
+    progress_last_items_g = items;
+  }
+
+  // Prefer bytes over items to measure the progress, since items vary in size
+  gint64 eta = -1;
+  gint32 percent = -1;
+
+  if (progress_bytes_total_g > 0) {
+    eta = dk_progress_eta(bytes, progress_bytes_total_g, progress_bytes_rate_g);
+    percent = MIN(bytes * 100 / progress_bytes_total_g, 100);
+  } else if (progress_items_total_g > 0) {
+    eta = dk_progress_eta(items, progress_items_total_g, progress_items_rate_g);
+    percent = MIN(items * 100 / progress_items_total_g, 100);
+  }
+
+  g_variant_builder_init(&builder, G_VARIANT_TYPE_VARDICT);
+
+  g_variant_builder_add(&builder, "{sv}", "bytes", g_variant_new_uint64(bytes));
+  g_variant_builder_add(&builder, "{sv}", "items", g_variant_new_uint64(items));
+  g_variant_builder_add(&builder, "{sv}", "bytes_per_sec", g_variant_new_double(progress_bytes_rate_g));
+  g_variant_builder_add(&builder, "{sv}", "items_per_sec", g_variant_new_double(progress_items_rate_g));
+
+  if (progress_bytes_total_g > 0)
+    g_variant_builder_add(&builder, "{sv}", "bytes_total", g_variant_new_uint64(progress_bytes_total_g));
+
+  if (progress_items_total_g > 0)
+    g_variant_builder_add(&builder, "{sv}", "items_total", g_variant_new_uint64(progress_items_total_g));
+
+  if (percent >= 0)
+    g_variant_builder_add(&builder, "{sv}", "percent", g_variant_new_int32(percent));
+
+  if (eta >= 0)
+    g_variant_builder_add(&builder, "{sv}", "eta", g_variant_new_int64(eta));
+
+  g_mutex_unlock(&progress_lock_g);
+
+  return g_variant_builder_end(&builder);
+}
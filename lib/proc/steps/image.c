@@ -0,0 +1,495 @@
+/**
+ * @file image.c
+ * @author Junde Yhi <lmy441900@aosc.xyz>
+ * @copyright (C) 2019-2020 Anthon Open Source Community
+ *
+ * Implementation of the image deployment step, an alternative to the tarball
+ * extraction in extract.c which writes a prebuilt file system image onto the
+ * target partition block by block.
+ */
+
+#define _GNU_SOURCE // O_DIRECT, SEEK_DATA, SEEK_HOLE
+
+#include <steps.h>
+#include <log.h>
+#include <mem.h>
+#include <progress.h>
+#include <glib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/falloc.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+/**
+ * Alignment of the I/O buffer, and of the offsets and lengths used with
+ * `O_DIRECT`.
+ */
+#define DK_IMAGE_ALIGN 4096
+
+/**
+ * Size of a chunk read from the image and written to the target at a time.
+ */
+#define DK_IMAGE_CHUNK_SIZE (4 * 1024 * 1024)
+
+/**
+ * Zeroes written to targets that cannot zero a range by themselves.
+ */
+static const char dk_image_zeroes[64 * 1024] __attribute__((aligned(DK_IMAGE_ALIGN)));
+
+/**
+ * State of the target while an image is being written.
+ */
+struct DkImageTarget {
+  const char *path;     ///< Path to the target.
+  int fd;               ///< File descriptor of the target.
+  bool blk;             ///< Whether the target is a block device.
+  bool direct;          ///< Whether `O_DIRECT` is in use.
+  off_t zero_from;      ///< Offset after which the target is known to read as zeroes.
+  guint64 written;      ///< Bytes of data written.
+  guint64 zeroed;       ///< Bytes explicitly zeroed.
+  guint64 skipped;      ///< Bytes of zeroes not written since the target has them.
+};
+
+/********** Private APIs **********/
+
+/**
+ * Check whether a buffer consists of zeroes only.
+ *
+ * @param buf [in] The buffer.
+ * @param len [in] Length of the buffer, greater than 0.
+ * @return `true` if every byte in `buf` is 0.
+ */
+static bool dk_image_is_zero(const char *buf, const size_t len)
+{
+  // If the first byte is 0 and each byte equals to the next one, all are 0
+  return buf[0] == 0 && memcmp(buf, buf + 1, len - 1) == 0;
+}
+
+/**
+ * Read until `len` bytes are read or the end of file is reached.
+ *
+ * @param fd  [in]  The file descriptor to read from.
+ * @param buf [out] The buffer.
+ * @param len [in]  Number of bytes to read.
+ * @param off [in]  Offset in the file to read from.
+ * @return Number of bytes read, or -1 on error.
+ */
+static ssize_t dk_image_pread_full(const int fd, char *buf, const size_t len, const off_t off)
+{
+  size_t done = 0;
+
+  while (done < len) {
+    ssize_t r = pread(fd, buf + done, len - done, off + done);
+    if (r < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+
+    if (r == 0)
+      break; // EOF
+
+    done += r;
+  }
+
+  return done;
+}
+
+/**
+ * Write all `len` bytes.
+ *
+ * @param fd  [in] The file descriptor to write to.
+ * @param buf [in] The buffer.
+ * @param len [in] Number of bytes to write.
+ * @param off [in] Offset in the file to write to.
+ * @return Non-0 if the operation succeed.
+ */
+static int dk_image_pwrite_full(const int fd, const char *buf, const size_t len, const off_t off)
+{
+  size_t done = 0;
+
+  while (done < len) {
+    ssize_t r = pwrite(fd, buf + done, len - done, off + done);
+    if (r < 0) {
+      if (errno == EINTR)
+        continue;
+      return 0;
+    }
+
+    done += r;
+  }
+
+  return 1;
+}
+
+/**
+ * Turn `O_DIRECT` on or off on an opened file descriptor.
+ *
+ * @param fd     [in] The file descriptor.
+ * @param direct [in] Whether `O_DIRECT` should be set.
+ * @return Non-0 if the operation succeed.
+ */
+static int dk_image_set_direct(const int fd, const bool direct)
+{
+  int flags = fcntl(fd, F_GETFL);
+  if (flags < 0)
+    return 0;
+
+  flags = direct ? (flags | O_DIRECT) : (flags & ~O_DIRECT);
+
+  return fcntl(fd, F_SETFL, flags) == 0;
+}
+
+/**
+ * Write to the target.
+ *
+ * `O_DIRECT` requires lengths aligned to #DK_IMAGE_ALIGN, which is not the case
+ * for the tail of an image whose size is not aligned, so it is temporarily
+ * turned off for that.
+ *
+ * @param target [in] A #DkImageTarget.
+ * @param buf    [in] The buffer, aligned to #DK_IMAGE_ALIGN.
+ * @param len    [in] Number of bytes to write.
+ * @param off    [in] Offset in the target, aligned to #DK_IMAGE_ALIGN.
+ * @return Non-0 if the operation succeed.
+ */
+static int dk_image_write(struct DkImageTarget *target, const char *buf, const size_t len, const off_t off)
+{
+  bool toggle = target->direct && (len % DK_IMAGE_ALIGN) != 0;
+
+  if (toggle && !dk_image_set_direct(target->fd, false)) {
+    dk_error("Failed to turn off O_DIRECT on %s: %s", target->path, g_strerror(errno));
+    return 0;
+  }
+
+  if (!dk_image_pwrite_full(target->fd, buf, len, off)) {
+    dk_error("Failed to write to %s: %s", target->path, g_strerror(errno));
+    return 0;
+  }
+
+  if (toggle && !dk_image_set_direct(target->fd, true)) {
+    dk_error("Failed to turn on O_DIRECT on %s: %s", target->path, g_strerror(errno));
+    return 0;
+  }
+
+  return 1;
+}
+
+/**
+ * Make a range of the target read as zeroes.
+ *
+ * Creating a partition does not wipe it, so ranges that are zero or holes in
+ * the image cannot simply be skipped: the file system in the image may use
+ * them (e.g. files full of zeroes, or inode tables), and stale data there would
+ * corrupt it. Block devices are asked to zero the range (`BLKZEROOUT`, which
+ * the device may offload), and regular files get a hole punched. Zeroes are
+ * only written if neither works.
+ *
+ * @param target [in] A #DkImageTarget.
+ * @param off    [in] Offset of the range, aligned to #DK_IMAGE_ALIGN.
+ * @param len    [in] Length of the range.
+ * @return Non-0 if the operation succeed.
+ */
+static int dk_image_zero(struct DkImageTarget *target, off_t off, off_t len)
+{
+  if (len <= 0)
+    return 1;
+
+  // Beyond what was on the target before, e.g. after extending a regular file
+  if (off + len > target->zero_from) {
+    off_t known = off + len - MAX(off, target->zero_from);
+    target->skipped += known;
+    len -= known;
+  }
+
+  if (len <= 0)
+    return 1;
+
+  target->zeroed += len;
+
+  if (target->blk) {
+    // BLKZEROOUT wants 512-byte aligned lengths; the tail is written below
+    guint64 range[2] = { off, len & ~(off_t)511 };
+    if (range[1] > 0 && ioctl(target->fd, BLKZEROOUT, range) == 0) {
+      off += range[1];
+      len -= range[1];
+    }
+  } else if (fallocate(target->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, len) == 0) {
+    return 1;
+  }
+
+  while (len > 0) {
+    size_t n = MIN(len, (off_t)sizeof(dk_image_zeroes));
+
+    if (!dk_image_write(target, dk_image_zeroes, n, off))
+      return 0;
+
+    off += n;
+    len -= n;
+  }
+
+  return 1;
+}
+
+/**
+ * Run an external program and wait for it.
+ *
+ * @param argv       [in] `NULL`-terminated argument vector; argv[0] is searched
+ *                        in `PATH`.
+ * @param max_status [in] The maximum exit status considered successful.
+ * @return Non-0 if the program exited with a status not greater than
+ *         `max_status`.
+ */
+static int dk_image_spawn(char **argv, const int max_status)
+{
+  char *err = NULL;
+  int status = 0;
+  GError *error = NULL;
+
+  gboolean r = g_spawn_sync(NULL, argv, NULL, G_SPAWN_SEARCH_PATH | G_SPAWN_STDOUT_TO_DEV_NULL, NULL, NULL, NULL, &err, &status, &error);
+  if (!r) {
+    dk_error("Failed to run %s: %s", argv[0], error->message);
+    g_clear_error(&error);
+    return 0;
+  }
+
+  if (!WIFEXITED(status) || WEXITSTATUS(status) > max_status) {
+    dk_error("%s failed: %s", argv[0], err ? err : "(no output)");
+    g_free(err);
+    return 0;
+  }
+
+  g_free(err);
+  return 1;
+}
+
+/**
+ * Grow the file system on the target to the size of the target.
+ *
+ * @param target  [in] Path to the target partition.
+ * @param fs_type [in] Type of the file system.
+ * @return Non-0 if the operation succeed, or if the file system cannot be grown
+ *         (which is not fatal).
+ */
+static int dk_image_grow(const char *target, const char *fs_type)
+{
+  if (g_strcmp0(fs_type, "ext2") != 0 && g_strcmp0(fs_type, "ext3") != 0 && g_strcmp0(fs_type, "ext4") != 0) {
+    dk_warning("Growing %s is not supported; the file system keeps the size of the image", fs_type);
+    return 1;
+  }
+
+  dk_info("Growing the %s file system on %s", fs_type, target);
+
+  // resize2fs refuses to work on a file system that is not freshly checked.
+  // e2fsck exits with 1 if errors are corrected, which is fine.
+  char *e2fsck_argv[] = { "e2fsck", "-f", "-y", (char *)target, NULL };
+  if (!dk_image_spawn(e2fsck_argv, 1))
+    return 0;
+
+  char *resize2fs_argv[] = { "resize2fs", (char *)target, NULL };
+  if (!dk_image_spawn(resize2fs_argv, 0))
+    return 0;
+
+  return 1;
+}
+
+/********** Public APIs **********/
+
+int dk_deploy_mode_parse(const char *mode, enum DkDeployMode *out)
+{
+  g_return_val_if_fail(out, 0);
+
+  if (!mode || g_strcmp0(mode, "extract") == 0) {
+    *out = DK_DEPLOY_MODE_EXTRACT;
+    return 1;
+  }
+
+  if (g_strcmp0(mode, "image") == 0) {
+    *out = DK_DEPLOY_MODE_IMAGE;
+    return 1;
+  }
+
+  dk_error("Unknown deploy mode: %s", mode);
+  return 0;
+}
+
+int dk_step_image_deploy(const char *image, const char *target_path, const char *fs_type)
+{
+  g_return_val_if_fail(image, 0);
+  g_return_val_if_fail(target_path, 0);
+
+  int ret = 0;
+  int image_fd = -1;
+  char *buf = NULL;
+  struct stat image_st, target_st;
+  struct DkImageTarget target = { .path = target_path, .fd = -1, .direct = true };
+
+  dk_info("Deploying image %s onto %s", image, target_path);
+
+  image_fd = open(image, O_RDONLY | O_CLOEXEC);
+  if (image_fd < 0) {
+    dk_error("Failed to open the image %s: %s", image, g_strerror(errno));
+    goto out;
+  }
+
+  target.fd = open(target_path, O_WRONLY | O_CLOEXEC | O_DIRECT);
+  if (target.fd < 0 && errno == EINVAL) {
+    dk_info("%s does not support O_DIRECT, falling back to buffered I/O", target_path);
+    target.direct = false;
+    target.fd = open(target_path, O_WRONLY | O_CLOEXEC);
+  }
+
+  if (target.fd < 0) {
+    dk_error("Failed to open the target %s: %s", target_path, g_strerror(errno));
+    goto out;
+  }
+
+  if (fstat(image_fd, &image_st) < 0 || fstat(target.fd, &target_st) < 0) {
+    dk_error("Failed to stat the image or the target: %s", g_strerror(errno));
+    goto out;
+  }
+
+  // The size of anything else cannot be told from st_size
+  if (!S_ISREG(image_st.st_mode)) {
+    dk_error("The image %s is not a regular file", image);
+    goto out;
+  }
+
+  if (S_ISBLK(target_st.st_mode)) {
+    off_t target_size = lseek(target.fd, 0, SEEK_END);
+    if (target_size < image_st.st_size) {
+      dk_error("The target %s (%" G_GINT64_FORMAT " bytes) is smaller than the image (%" G_GINT64_FORMAT " bytes)",
+               target_path, (gint64)target_size, (gint64)image_st.st_size);
+      goto out;
+    }
+
+    target.blk = true;
+    target.zero_from = target_size;
+  } else if (S_ISREG(target_st.st_mode)) {
+    // A regular file, e.g. backing a loop device, must be large enough to hold
+    // the whole file system, even if the image ends in a hole
+    if (target_st.st_size < image_st.st_size && ftruncate(target.fd, image_st.st_size) < 0) {
+      dk_error("Failed to extend the target %s: %s", target_path, g_strerror(errno));
+      goto out;
+    }
+
+    target.zero_from = target_st.st_size;
+  } else {
+    dk_error("The target %s is neither a block device nor a regular file", target_path);
+    goto out;
+  }
+
+  dk_progress_reset(image_st.st_size, 0);
+
+  dk_mem_acquire(DK_MEM_POOL_IO, DK_IMAGE_CHUNK_SIZE);
+
+  if (posix_memalign((void **)&buf, DK_IMAGE_ALIGN, DK_IMAGE_CHUNK_SIZE) != 0) {
+    dk_error("Failed to allocate the I/O buffer");
+    dk_mem_release(DK_MEM_POOL_IO, DK_IMAGE_CHUNK_SIZE);
+    buf = NULL;
+    goto out;
+  }
+
+  // Walk through the data extents of the image, i.e. the sparse map maintained
+  // by the file system holding it. Holes are never read. Holes and chunks of
+  // zeroes are gathered into a single range which is zeroed on the target
+  // before the next write. Skipped holes count as processed too, so that the
+  // progress reaches the size of the image.
+  off_t end = 0, zero_start = 0, reported = 0;
+  while (end < image_st.st_size) {
+    off_t data = lseek(image_fd, end, SEEK_DATA);
+    if (data < 0) {
+      if (errno == ENXIO)
+        break; // No more data till EOF
+
+      dk_error("Failed to seek in the image: %s", g_strerror(errno));
+      goto out;
+    }
+
+    off_t hole = lseek(image_fd, data, SEEK_HOLE);
+    if (hole < 0)
+      hole = image_st.st_size;
+
+    // Extents are aligned to the file system block size, which can be smaller
+    // than what O_DIRECT wants, so widen them to the alignment. The previous
+    // extent is never processed twice since its end is aligned the same way.
+    data = MAX(data & ~(off_t)(DK_IMAGE_ALIGN - 1), end);
+    hole = MIN((hole + DK_IMAGE_ALIGN - 1) & ~(off_t)(DK_IMAGE_ALIGN - 1), image_st.st_size);
+
+    off_t off = data;
+    while (off < hole) {
+      size_t want = MIN((off_t)DK_IMAGE_CHUNK_SIZE, hole - off);
+
+      ssize_t n = dk_image_pread_full(image_fd, buf, want, off);
+      if (n < 0) {
+        dk_error("Failed to read the image: %s", g_strerror(errno));
+        goto out;
+      }
+
+      if (n == 0)
+        break;
+
+      if (!dk_image_is_zero(buf, n)) {
+        if (!dk_image_zero(&target, zero_start, off - zero_start))
+          goto out;
+
+        if (!dk_image_write(&target, buf, n, off))
+          goto out;
+
+        target.written += n;
+        zero_start = off + n;
+      }
+
+      off += n;
+
+      dk_progress_add(off - reported, 0);
+      reported = off;
+    }
+
+    end = MAX(off, hole);
+  }
+
+  if (!dk_image_zero(&target, zero_start, image_st.st_size - zero_start))
+    goto out;
+
+  dk_progress_add(image_st.st_size - reported, 0);
+
+  if (fsync(target.fd) < 0) {
+    dk_error("Failed to sync %s: %s", target_path, g_strerror(errno));
+    goto out;
+  }
+
+  // Tools growing the file system want the target for themselves
+  close(target.fd);
+  target.fd = -1;
+
+  dk_info("Wrote %" G_GUINT64_FORMAT " bytes of data, zeroed %" G_GUINT64_FORMAT " bytes, and skipped %" G_GUINT64_FORMAT " bytes already zero",
+          target.written, target.zeroed, target.skipped);
+
+  if (fs_type && !dk_image_grow(target_path, fs_type))
+    goto out;
+
+  ret = 1;
+
+out:
+  if (buf) {
+    free(buf);
+    dk_mem_release(DK_MEM_POOL_IO, DK_IMAGE_CHUNK_SIZE);
+  }
+
+  if (target.fd >= 0)
+    close(target.fd);
+
+  if (image_fd >= 0)
+    close(image_fd);
+
+  return ret;
+}
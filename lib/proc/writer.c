@@ -0,0 +1,531 @@
+/**
+ * @file writer.c
+ * @author Junde Yhi <lmy441900@aosc.xyz>
+ * @copyright (C) 2019-2020 Anthon Open Source Community
+ *
+ * Implementation of the batching file writer used by the extract and packages
+ * steps to create many small files.
+ */
+
+#define _GNU_SOURCE
+
+#include "config.h"
+#include <writer.h>
+#include <log.h>
+#include <mem.h>
+#include <progress.h>
+#include <glib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+/**
+ * Maximum number of files queued in a #DkWriter before it is flushed.
+ *
+ * With io_uring, this is also the number of registered file slots.
+ */
+#define DK_WRITER_BATCH 64
+
+/**
+ * Number of io_uring submission queue entries. Each file takes at most three:
+ * `openat`, `write` and `close`.
+ */
+#define DK_WRITER_RING_ENTRIES 256
+
+/**
+ * Largest file written through io_uring. A single write takes an `unsigned`
+ * length and Linux caps it a bit below 2 GiB, so larger files are written with
+ * the synchronous backend, which loops.
+ */
+#define DK_WRITER_URING_MAX_LEN (1U << 30)
+
+/**
+ * Flags used to create a file.
+ */
+#define DK_WRITER_OPEN_FLAGS (O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC)
+
+/**
+ * A file queued in a #DkWriter.
+ */
+struct DkWriterFile {
+  int dirfd;   ///< The directory DkWriterFile::path is relative to.
+  char *path;  ///< Path to the file.
+  char *data;  ///< Content of the file.
+  size_t len;  ///< Length of DkWriterFile::data.
+  mode_t mode; ///< Permission bits of the file.
+};
+
+struct DkWriter {
+  enum DkWriterBackend backend;                ///< The backend in use.
+  struct DkWriterFile files[DK_WRITER_BATCH];  ///< Queued files.
+  unsigned int nr_files;                       ///< Number of queued files.
+#ifdef HAVE_LIBURING
+  struct io_uring ring;                        ///< The io_uring instance.
+#endif
+};
+
+/********** Private APIs **********/
+
+/**
+ * Free the content of a #DkWriterFile.
+ *
+ * @param file [in] A #DkWriterFile.
+ */
+static void dk_writer_file_clear(struct DkWriterFile *file)
+{
+  if (file->path)
+    dk_mem_release(DK_MEM_POOL_WRITE, file->len + strlen(file->path) + 1);
+
+  g_clear_pointer(&file->path, g_free);
+  g_clear_pointer(&file->data, g_free);
+  file->len = 0;
+}
+
+/**
+ * Write a file with blocking system calls.
+ *
+ * @param file [in] A #DkWriterFile.
+ * @return Non-0 if the operation succeed.
+ */
+static int dk_writer_write_sync(const struct DkWriterFile *file)
+{
+  int fd = openat(file->dirfd, file->path, DK_WRITER_OPEN_FLAGS, file->mode);
+  if (fd < 0) {
+    dk_error("Failed to create %s: %s", file->path, g_strerror(errno));
+    return 0;
+  }
+
+  size_t done = 0;
+  while (done < file->len) {
+    ssize_t r = write(fd, file->data + done, file->len - done);
+    if (r < 0) {
+      if (errno == EINTR)
+        continue;
+
+      dk_error("Failed to write %s: %s", file->path, g_strerror(errno));
+      close(fd);
+      return 0;
+    }
+
+    done += r;
+  }
+
+  if (fchmod(fd, file->mode) < 0) {
+    dk_error("Failed to change the mode of %s: %s", file->path, g_strerror(errno));
+    close(fd);
+    return 0;
+  }
+
+  if (close(fd) < 0) {
+    dk_error("Failed to close %s: %s", file->path, g_strerror(errno));
+    return 0;
+  }
+
+  dk_progress_add(file->len, 1);
+  return 1;
+}
+
+/**
+ * Write all queued files with blocking system calls.
+ *
+ * @param writer [in] A #DkWriter.
+ * @return Non-0 if the operation succeed.
+ */
+static int dk_writer_flush_sync(struct DkWriter *writer)
+{
+  int ret = 1;
+
+  for (unsigned int i = 0; i < writer->nr_files; i++)
+    if (!dk_writer_write_sync(&writer->files[i]))
+      ret = 0;
+
+  return ret;
+}
+
+#ifdef HAVE_LIBURING
+
+/**
+ * Operations submitted for a file, encoded into the user data of an SQE
+ * together with the index of the file.
+ */
+enum DkWriterOp {
+  DK_WRITER_OP_OPEN,
+  DK_WRITER_OP_WRITE,
+  DK_WRITER_OP_CLOSE,
+};
+
+/**
+ * Set up io_uring for a #DkWriter.
+ *
+ * @param writer [in] A #DkWriter.
+ * @return Non-0 if io_uring, and the direct descriptors needed to chain
+ *         `openat`, `write` and `close` together, are supported.
+ */
+static int dk_writer_uring_init(struct DkWriter *writer)
+{
+  int r = io_uring_queue_init(DK_WRITER_RING_ENTRIES, &writer->ring, 0);
+  if (r < 0) {
+    dk_info("io_uring is unavailable: %s", g_strerror(-r));
+    return 0;
+  }
+
+  r = io_uring_register_files_sparse(&writer->ring, DK_WRITER_BATCH);
+  if (r < 0) {
+    dk_info("io_uring does not support sparse file registration: %s", g_strerror(-r));
+    io_uring_queue_exit(&writer->ring);
+    return 0;
+  }
+
+  return 1;
+}
+
+/**
+ * Give up io_uring after a failure of the ring itself, and switch to the
+ * synchronous backend.
+ *
+ * Requests already submitted may still truncate and write the files of the
+ * current batch, and read their data, so all of their completions are
+ * collected first, cancelling them if waiting fails. Only then is the ring torn
+ * down, which drops submission queue entries not yet submitted and closes all
+ * direct descriptors.
+ *
+ * If the requests cannot be collected, the ring and the data of the batch are
+ * leaked on purpose, since the kernel may still use them.
+ *
+ * @param writer    [in] A #DkWriter.
+ * @param in_flight [in] Number of requests submitted but not yet completed.
+ * @return Non-0 if no request is running anymore, so that the batch can be
+ *         written again.
+ */
+static int dk_writer_uring_abandon(struct DkWriter *writer, unsigned int in_flight)
+{
+  bool cancelled = false;
+
+  dk_warning("Falling back to synchronous file writing");
+
+  writer->backend = DK_WRITER_BACKEND_SYNC;
+
+  while (in_flight > 0) {
+    struct io_uring_cqe *cqe = NULL;
+    int r = io_uring_wait_cqe(&writer->ring, &cqe);
+    if (r == -EINTR)
+      continue;
+
+    if (r < 0 && !cancelled) {
+      struct io_uring_sync_cancel_reg reg = {
+        .fd = -1,
+        .flags = IORING_ASYNC_CANCEL_ANY,
+        .timeout = { .tv_sec = -1, .tv_nsec = -1 },
+      };
+
+      r = io_uring_register_sync_cancel(&writer->ring, &reg);
+      if (r < 0 && r != -ENOENT)
+        dk_warning("Failed to cancel io_uring requests: %s", g_strerror(-r));
+
+      cancelled = true;
+      continue;
+    }
+
+    if (r < 0) {
+      dk_error("Failed to wait for io_uring completions: %s", g_strerror(-r));
+
+      for (unsigned int i = 0; i < writer->nr_files; i++)
+        writer->files[i].data = NULL;
+
+      return 0;
+    }
+
+    io_uring_cqe_seen(&writer->ring, cqe);
+    in_flight--;
+  }
+
+  io_uring_queue_exit(&writer->ring);
+  return 1;
+}
+
+/**
+ * Write all queued files through io_uring.
+ *
+ * Each file is submitted as a linked chain of `openat`, `write` and `close` on
+ * a direct descriptor, so one submission covers the whole batch. io_uring has
+ * no `fchmod`, and `openat` ignores the mode of files that already exist, so
+ * fchmodat() is done afterwards for every file. Files too large for a single
+ * write, or cut short by one, are written synchronously after the batch.
+ *
+ * If the ring itself fails, the writer waits for the requests already
+ * submitted, falls back to the synchronous backend and writes the whole batch
+ * again, which is fine since files are truncated.
+ *
+ * @param writer [in] A #DkWriter.
+ * @return Non-0 if the operation succeed.
+ */
+static int dk_writer_flush_uring(struct DkWriter *writer)
+{
+  int ret = 1;
+  unsigned int nr_sqes = 0;
+  bool opened[DK_WRITER_BATCH] = { false };
+  bool ok[DK_WRITER_BATCH];
+  bool sync[DK_WRITER_BATCH] = { false };
+
+  for (unsigned int i = 0; i < writer->nr_files; i++) {
+    struct DkWriterFile *file = &writer->files[i];
+    struct io_uring_sqe *sqe = NULL;
+
+    ok[i] = true;
+
+    if (file->len > DK_WRITER_URING_MAX_LEN) {
+      sync[i] = true;
+      continue;
+    }
+
+    sqe = io_uring_get_sqe(&writer->ring);
+    io_uring_prep_openat_direct(sqe, file->dirfd, file->path, DK_WRITER_OPEN_FLAGS, file->mode, i);
+    io_uring_sqe_set_data64(sqe, ((guint64)i << 2) | DK_WRITER_OP_OPEN);
+    sqe->flags |= IOSQE_IO_LINK;
+    nr_sqes++;
+
+    if (file->len > 0) {
+      sqe = io_uring_get_sqe(&writer->ring);
+      io_uring_prep_write(sqe, i, file->data, file->len, 0);
+      io_uring_sqe_set_data64(sqe, ((guint64)i << 2) | DK_WRITER_OP_WRITE);
+      sqe->flags |= IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+      nr_sqes++;
+    }
+
+    sqe = io_uring_get_sqe(&writer->ring);
+    io_uring_prep_close_direct(sqe, i);
+    io_uring_sqe_set_data64(sqe, ((guint64)i << 2) | DK_WRITER_OP_CLOSE);
+    nr_sqes++;
+  }
+
+  // The kernel may take fewer entries than given, e.g. when it runs short of
+  // memory; the rest stay in the submission queue and are submitted again
+  unsigned int submitted = 0, completed = 0;
+  while (completed < nr_sqes) {
+    if (submitted < nr_sqes) {
+      int r = io_uring_submit(&writer->ring);
+      if (r < 0 && r != -EAGAIN && r != -EBUSY && r != -EINTR) {
+        dk_error("Failed to submit to io_uring: %s", g_strerror(-r));
+        return dk_writer_uring_abandon(writer, submitted - completed) && dk_writer_flush_sync(writer);
+      }
+
+      if (r > 0)
+        submitted += r;
+    }
+
+    if (submitted == completed) {
+      // Nothing is in flight to wait for, and nothing could be submitted
+      dk_error("io_uring accepts no submission");
+      return dk_writer_uring_abandon(writer, submitted - completed) && dk_writer_flush_sync(writer);
+    }
+
+    struct io_uring_cqe *cqe = NULL;
+    int r = io_uring_wait_cqe(&writer->ring, &cqe);
+    if (r == -EINTR)
+      continue;
+
+    if (r < 0) {
+      dk_error("Failed to wait for io_uring completions: %s", g_strerror(-r));
+      return dk_writer_uring_abandon(writer, submitted - completed) && dk_writer_flush_sync(writer);
+    }
+
+    // Drain everything already completed
+    do {
+      guint64 data = io_uring_cqe_get_data64(cqe);
+      unsigned int i = data >> 2;
+      struct DkWriterFile *file = &writer->files[i];
+      enum DkWriterOp op = data & 3;
+
+      if (op == DK_WRITER_OP_OPEN && cqe->res >= 0)
+        opened[i] = true;
+      else if (op == DK_WRITER_OP_CLOSE && cqe->res >= 0)
+        opened[i] = false;
+
+      // Operations following a failed one in a chain are cancelled; only the
+      // failure itself is worth reporting
+      if (cqe->res < 0) {
+        if (cqe->res != -ECANCELED)
+          dk_error("Failed to %s %s: %s",
+                   op == DK_WRITER_OP_OPEN ? "create" : op == DK_WRITER_OP_WRITE ? "write" : "close",
+                   file->path, g_strerror(-cqe->res));
+        ok[i] = false;
+      } else if (op == DK_WRITER_OP_WRITE && (size_t)cqe->res != file->len) {
+        // The linked close is cancelled; the file is written again afterwards
+        dk_debug("Short write to %s: %d of %zu bytes, retrying synchronously", file->path, cqe->res, file->len);
+        sync[i] = true;
+      }
+
+      io_uring_cqe_seen(&writer->ring, cqe);
+      completed++;
+    } while (io_uring_peek_cqe(&writer->ring, &cqe) == 0);
+  }
+
+  for (unsigned int i = 0; i < writer->nr_files; i++) {
+    struct DkWriterFile *file = &writer->files[i];
+
+    // A failed write cancels the linked close, leaving the slot occupied
+    if (opened[i]) {
+      int fd = -1;
+      io_uring_register_files_update(&writer->ring, i, &fd, 1);
+    }
+
+    if (sync[i]) {
+      if (!dk_writer_write_sync(file))
+        ret = 0;
+
+      continue;
+    }
+
+    if (!ok[i]) {
+      ret = 0;
+      continue;
+    }
+
+    if (fchmodat(file->dirfd, file->path, file->mode, 0) < 0) {
+      dk_error("Failed to change the mode of %s: %s", file->path, g_strerror(errno));
+      ret = 0;
+      continue;
+    }
+
+    dk_progress_add(file->len, 1);
+  }
+
+  return ret;
+}
+
+#endif
+
+/********** Public APIs **********/
+
+struct DkWriter *dk_writer_new(void)
+{
+  struct DkWriter *writer = dk_writer_new_with_backend(DK_WRITER_BACKEND_IO_URING);
+  if (!writer)
+    writer = dk_writer_new_with_backend(DK_WRITER_BACKEND_SYNC);
+
+  return writer;
+}
+
+struct DkWriter *dk_writer_new_with_backend(enum DkWriterBackend backend)
+{
+  struct DkWriter *writer = g_malloc0(sizeof(struct DkWriter));
+
+  writer->backend = backend;
+
+  switch (backend) {
+    case DK_WRITER_BACKEND_SYNC:
+      break;
+    case DK_WRITER_BACKEND_IO_URING:
+#ifdef HAVE_LIBURING
+      if (dk_writer_uring_init(writer))
+        break;
+#endif
+      g_free(writer);
+      return NULL;
+    default:
+      g_warn_if_reached();
+      g_free(writer);
+      return NULL;
+  }
+
+  dk_debug("Created a file writer with the %s backend",
+           writer->backend == DK_WRITER_BACKEND_IO_URING ? "io_uring" : "synchronous");
+
+  return writer;
+}
+
+enum DkWriterBackend dk_writer_get_backend(const struct DkWriter *writer)
+{
+  g_return_val_if_fail(writer, DK_WRITER_BACKEND_SYNC);
+
+  return writer->backend;
+}
+
+int dk_writer_add(struct DkWriter *writer, int dirfd, const char *path, const void *data, size_t len, mode_t mode)
+{
+  g_return_val_if_fail(writer, 0);
+  g_return_val_if_fail(path, 0);
+  g_return_val_if_fail(data || len == 0, 0);
+
+  int ret = 1;
+  size_t size = len + strlen(path) + 1;
+
+  if (writer->nr_files == DK_WRITER_BATCH)
+    ret = dk_writer_flush(writer);
+
+  // Queued files can only be released by this writer, so write them out before
+  // waiting for others to release memory
+  if (!dk_mem_try_acquire(DK_MEM_POOL_WRITE, size)) {
+    if (!dk_writer_flush(writer))
+      ret = 0;
+
+    dk_mem_acquire(DK_MEM_POOL_WRITE, size);
+  }
+
+  struct DkWriterFile *file = &writer->files[writer->nr_files++];
+
+  file->dirfd = dirfd;
+  file->path  = g_strdup(path);
+  file->data  = g_malloc(len);
+  file->len   = len;
+  file->mode  = mode;
+
+  if (len > 0)
+    memcpy(file->data, data, len);
+
+  return ret;
+}
+
+int dk_writer_flush(struct DkWriter *writer)
+{
+  g_return_val_if_fail(writer, 0);
+
+  int ret = 1;
+
+  if (writer->nr_files == 0)
+    return ret;
+
+  switch (writer->backend) {
+    case DK_WRITER_BACKEND_SYNC:
+      ret = dk_writer_flush_sync(writer);
+      break;
+#ifdef HAVE_LIBURING
+    case DK_WRITER_BACKEND_IO_URING:
+      ret = dk_writer_flush_uring(writer);
+      break;
+#endif
+    default:
+      g_warn_if_reached();
+      ret = 0;
+      break;
+  }
+
+  for (unsigned int i = 0; i < writer->nr_files; i++)
+    dk_writer_file_clear(&writer->files[i]);
+
+  writer->nr_files = 0;
+
+  return ret;
+}
+
+void dk_writer_free(struct DkWriter *writer)
+{
+  g_return_if_fail(writer);
+
+  for (unsigned int i = 0; i < writer->nr_files; i++)
+    dk_writer_file_clear(&writer->files[i]);
+
+#ifdef HAVE_LIBURING
+  if (writer->backend == DK_WRITER_BACKEND_IO_URING)
+    io_uring_queue_exit(&writer->ring);
+#endif
+
+  g_free(writer);
+}
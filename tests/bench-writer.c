@@ -0,0 +1,205 @@
+/**
+ * @file bench-writer.c
+ * @author Junde Yhi <lmy441900@aosc.xyz>
+ * @copyright (C) 2019-2020 Anthon Open Source Community
+ *
+ * Benchmark of the file writer, measuring files per second with each backend.
+ *
+ * Without arguments, files are written into /dev/shm (tmpfs) and, if running as
+ * root with e2fsprogs available, into a loop-mounted ext4 image. Directories
+ * given as arguments are used instead.
+ */
+
+#include <writer.h>
+#include <log.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+/**
+ * Number of files written per run, given by `--files`.
+ */
+static gint files_g = 20000;
+
+/**
+ * Size of each file, given by `--size`.
+ */
+static gint size_g = 4096;
+
+/**
+ * Command line options.
+ */
+static GOptionEntry options_g[] = {
+  { "files", 'n', 0, G_OPTION_ARG_INT, &files_g, "Number of files written per run", "N" },
+  { "size", 's', 0, G_OPTION_ARG_INT, &size_g, "Size of each file in bytes", "BYTES" },
+  { NULL }
+};
+
+/**
+ * Run a command quietly.
+ *
+ * @return `TRUE` if it exits with 0.
+ */
+static gboolean run(char **argv)
+{
+  int status = -1;
+
+  if (!g_spawn_sync(NULL, argv, NULL, G_SPAWN_SEARCH_PATH | G_SPAWN_STDOUT_TO_DEV_NULL | G_SPAWN_STDERR_TO_DEV_NULL, NULL, NULL, NULL, NULL, &status, NULL))
+    return FALSE;
+
+  return status == 0;
+}
+
+/**
+ * Write #files_g files into `dir` with `backend`, and print the throughput.
+ */
+static void bench(const char *dir, const char *label, enum DkWriterBackend backend)
+{
+  struct DkWriter *writer = dk_writer_new_with_backend(backend);
+  const char *name = backend == DK_WRITER_BACKEND_IO_URING ? "io_uring" : "sync";
+
+  if (!writer) {
+    printf("%-8s %-9s unsupported\n", label, name);
+    return;
+  }
+
+  char *work = g_build_filename(dir, "bench-writer-XXXXXX", NULL);
+  if (!g_mkdtemp(work)) {
+    printf("%-8s %-9s cannot create a directory in %s\n", label, name, dir);
+    g_free(work);
+    dk_writer_free(writer);
+    return;
+  }
+
+  int dirfd = open(work, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dirfd < 0)
+    g_error("Cannot open %s", work);
+
+  char *data = g_malloc(size_g);
+  memset(data, 'x', size_g);
+
+  gint64 start = g_get_monotonic_time();
+
+  for (int i = 0; i < files_g; i++) {
+    char path[32];
+    g_snprintf(path, sizeof(path), "%d", i);
+    if (!dk_writer_add(writer, dirfd, path, data, size_g, 0644))
+      g_error("Failed to write %s/%s", work, path);
+  }
+
+  if (!dk_writer_flush(writer))
+    g_error("Failed to write files into %s", work);
+
+  gint64 elapsed = g_get_monotonic_time() - start;
+
+  printf("%-8s %-9s %d files in %.3f s, %.0f files/s\n",
+         label, name, files_g, elapsed / 1e6, files_g * 1e6 / MAX(elapsed, 1));
+
+  for (int i = 0; i < files_g; i++) {
+    char path[32];
+    g_snprintf(path, sizeof(path), "%d", i);
+    unlinkat(dirfd, path, 0);
+  }
+
+  close(dirfd);
+  g_rmdir(work);
+
+  g_free(data);
+  g_free(work);
+  dk_writer_free(writer);
+}
+
+/**
+ * Run both backends against a directory.
+ */
+static void bench_dir(const char *dir, const char *label)
+{
+  bench(dir, label, DK_WRITER_BACKEND_SYNC);
+  bench(dir, label, DK_WRITER_BACKEND_IO_URING);
+}
+
+/**
+ * Run both backends against a freshly made, loop-mounted ext4 image.
+ */
+static void bench_ext4(void)
+{
+  if (geteuid() != 0) {
+    printf("ext4     skipped, loop mounting needs root\n");
+    return;
+  }
+
+  char *tmp = g_dir_make_tmp("libaoscdk-bench-XXXXXX", NULL);
+  if (!tmp) {
+    printf("ext4     skipped, cannot create a temporary directory\n");
+    return;
+  }
+
+  char *image = g_build_filename(tmp, "ext4.img", NULL);
+  char *mnt = g_build_filename(tmp, "mnt", NULL);
+  char *size = g_strdup_printf("%dM", MAX((int)((gint64)files_g * (size_g + 4096) * 2 / (1024 * 1024)), 64));
+
+  char *mkfs_argv[] = { "mkfs.ext4", "-q", "-F", image, size, NULL };
+  char *mount_argv[] = { "mount", "-o", "loop", image, mnt, NULL };
+  char *umount_argv[] = { "umount", mnt, NULL };
+
+  g_mkdir(mnt, 0755);
+
+  if (run(mkfs_argv) && run(mount_argv)) {
+    bench_dir(mnt, "ext4");
+    run(umount_argv);
+  } else {
+    printf("ext4     skipped, cannot create or mount an image\n");
+  }
+
+  g_rmdir(mnt);
+  g_remove(image);
+  g_rmdir(tmp);
+
+  g_free(size);
+  g_free(mnt);
+  g_free(image);
+  g_free(tmp);
+}
+
+int main(int argc, char **argv)
+{
+  GError *error = NULL;
+  GOptionContext *context = g_option_context_new("[DIRECTORY...]");
+
+  g_option_context_add_main_entries(context, options_g, NULL);
+
+  if (!g_option_context_parse(context, &argc, &argv, &error)) {
+    fprintf(stderr, "%s\n", error->message);
+    g_clear_error(&error);
+    g_option_context_free(context);
+    return 1;
+  }
+
+  g_option_context_free(context);
+
+  if (files_g <= 0 || size_g < 0) {
+    fprintf(stderr, "Invalid number or size of files\n");
+    return 1;
+  }
+
+  dk_log_init();
+
+  if (argc > 1) {
+    for (int i = 1; i < argc; i++)
+      bench_dir(argv[i], argv[i]);
+  } else {
+    if (g_file_test("/dev/shm", G_FILE_TEST_IS_DIR))
+      bench_dir("/dev/shm", "tmpfs");
+    else
+      printf("tmpfs    skipped, /dev/shm does not exist\n");
+
+    bench_ext4();
+  }
+
+  dk_log_deinit();
+
+  return 0;
+}
@@ -0,0 +1,216 @@
+/**
+ * @file checkpoint.c
+ * @author Junde Yhi <lmy441900@aosc.xyz>
+ * @copyright (C) 2019-2020 Anthon Open Source Community
+ *
+ * Tests of the checkpoint journal, with a temporary directory as the root of
+ * the target.
+ */
+
+#include <checkpoint.h>
+#include <writer.h>
+#include <log.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/**
+ * Per-test fixture.
+ */
+struct Fixture {
+  char *root;     ///< Temporary directory standing for the target.
+  char *journal;  ///< Path to the journal in Fixture::root.
+};
+
+static void fixture_set_up(struct Fixture *f, gconstpointer data)
+{
+  (void)data;
+
+  f->root = g_dir_make_tmp("libaoscdk-checkpoint-XXXXXX", NULL);
+  g_assert_nonnull(f->root);
+
+  f->journal = g_build_filename(f->root, DK_CHECKPOINT_FILE_NAME, NULL);
+
+  char *log = g_build_filename(f->root, "log", NULL);
+  dk_log_init();
+  dk_log_set_output_file(log); // Errors must not turn into fatal criticals
+  g_free(log);
+}
+
+static void fixture_tear_down(struct Fixture *f, gconstpointer data)
+{
+  (void)data;
+
+  dk_log_deinit();
+
+  // Everything written is flat in the directory
+  GDir *dir = g_dir_open(f->root, 0, NULL);
+  const char *name = NULL;
+
+  while ((name = g_dir_read_name(dir))) {
+    char *path = g_build_filename(f->root, name, NULL);
+    g_remove(path);
+    g_free(path);
+  }
+
+  g_dir_close(dir);
+  g_rmdir(f->root);
+
+  g_free(f->journal);
+  g_free(f->root);
+}
+
+/**
+ * Record a step and the extraction progress with `ir`.
+ */
+static void record(struct Fixture *f, const char *ir)
+{
+  struct DkCheckpoint *cp = dk_checkpoint_open(f->root, ir);
+
+  dk_checkpoint_set_interval(cp, 0);
+  g_assert_true(dk_checkpoint_step_done(cp, "partition"));
+  g_assert_true(dk_checkpoint_set_extract(cp, NULL, 1048576, "usr/bin/bash"));
+
+  dk_checkpoint_free(cp);
+}
+
+/**
+ * Check that the journal opened with `ir` is empty.
+ */
+static void check_empty(struct Fixture *f, const char *ir)
+{
+  struct DkCheckpoint *cp = dk_checkpoint_open(f->root, ir);
+  guint64 offset = 0;
+  char *last_file = NULL;
+
+  g_assert_false(dk_checkpoint_step_is_done(cp, "partition"));
+  g_assert_false(dk_checkpoint_get_extract(cp, &offset, &last_file));
+
+  dk_checkpoint_free(cp);
+}
+
+/**
+ * The same DKIR resumes the completed steps and the extraction progress.
+ */
+static void test_resume(struct Fixture *f, gconstpointer data)
+{
+  (void)data;
+
+  record(f, "ir-a");
+
+  struct DkCheckpoint *cp = dk_checkpoint_open(f->root, "ir-a");
+  guint64 offset = 0;
+  char *last_file = NULL;
+
+  g_assert_true(dk_checkpoint_step_is_done(cp, "partition"));
+  g_assert_false(dk_checkpoint_step_is_done(cp, "extract"));
+
+  g_assert_true(dk_checkpoint_get_extract(cp, &offset, &last_file));
+  g_assert_cmpuint(offset, ==, 1048576);
+  g_assert_cmpstr(last_file, ==, "usr/bin/bash");
+
+  g_free(last_file);
+  dk_checkpoint_free(cp);
+}
+
+/**
+ * Another DKIR discards the journal.
+ */
+static void test_other_ir(struct Fixture *f, gconstpointer data)
+{
+  (void)data;
+
+  record(f, "ir-a");
+  check_empty(f, "ir-b");
+}
+
+/**
+ * An empty or unparsable journal starts over.
+ */
+static void test_invalid(struct Fixture *f, gconstpointer data)
+{
+  (void)data;
+
+  g_assert_true(g_file_set_contents(f->journal, "", 0, NULL));
+  check_empty(f, "ir-a");
+
+  g_assert_true(g_file_set_contents(f->journal, "not a key file\n", -1, NULL));
+  check_empty(f, "ir-a");
+}
+
+/**
+ * The extraction progress is not written within the interval, and the writer
+ * is flushed before it is.
+ */
+static void test_set_extract(struct Fixture *f, gconstpointer data)
+{
+  (void)data;
+
+  struct DkCheckpoint *cp = dk_checkpoint_open(f->root, "ir-a");
+  struct DkWriter *writer = dk_writer_new_with_backend(DK_WRITER_BACKEND_SYNC);
+  char *file = g_build_filename(f->root, "file", NULL);
+
+  int dirfd = open(f->root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  g_assert_cmpint(dirfd, >=, 0);
+
+  g_assert_true(dk_writer_add(writer, dirfd, "file", "content", 7, 0644));
+
+  // Within the default interval from opening: nothing happens
+  g_assert_true(dk_checkpoint_set_extract(cp, writer, 4096, "file"));
+  g_assert_false(g_file_test(file, G_FILE_TEST_EXISTS));
+  check_empty(f, "ir-a");
+
+  dk_checkpoint_set_interval(cp, 0);
+
+  g_assert_true(dk_checkpoint_set_extract(cp, writer, 4096, "file"));
+  g_assert_true(g_file_test(file, G_FILE_TEST_EXISTS));
+
+  struct DkCheckpoint *reopened = dk_checkpoint_open(f->root, "ir-a");
+  guint64 offset = 0;
+  char *last_file = NULL;
+
+  g_assert_true(dk_checkpoint_get_extract(reopened, &offset, &last_file));
+  g_assert_cmpuint(offset, ==, 4096);
+  g_assert_cmpstr(last_file, ==, "file");
+
+  g_free(last_file);
+  dk_checkpoint_free(reopened);
+
+  close(dirfd);
+  g_free(file);
+  dk_writer_free(writer);
+  dk_checkpoint_free(cp);
+}
+
+/**
+ * Finishing removes the journal, even twice.
+ */
+static void test_finish(struct Fixture *f, gconstpointer data)
+{
+  (void)data;
+
+  record(f, "ir-a");
+  g_assert_true(g_file_test(f->journal, G_FILE_TEST_EXISTS));
+
+  struct DkCheckpoint *cp = dk_checkpoint_open(f->root, "ir-a");
+
+  g_assert_true(dk_checkpoint_finish(cp));
+  g_assert_false(g_file_test(f->journal, G_FILE_TEST_EXISTS));
+  g_assert_true(dk_checkpoint_finish(cp));
+
+  dk_checkpoint_free(cp);
+}
+
+int main(int argc, char **argv)
+{
+  g_test_init(&argc, &argv, NULL);
+
+  g_test_add("/checkpoint/resume", struct Fixture, NULL, fixture_set_up, test_resume, fixture_tear_down);
+  g_test_add("/checkpoint/other-ir", struct Fixture, NULL, fixture_set_up, test_other_ir, fixture_tear_down);
+  g_test_add("/checkpoint/invalid", struct Fixture, NULL, fixture_set_up, test_invalid, fixture_tear_down);
+  g_test_add("/checkpoint/set-extract", struct Fixture, NULL, fixture_set_up, test_set_extract, fixture_tear_down);
+  g_test_add("/checkpoint/finish", struct Fixture, NULL, fixture_set_up, test_finish, fixture_tear_down);
+
+  return g_test_run();
+}
@@ -0,0 +1,210 @@
+/**
+ * @file image.c
+ * @author Junde Yhi <lmy441900@aosc.xyz>
+ * @copyright (C) 2019-2020 Anthon Open Source Community
+ *
+ * Tests of the image deployment step, against regular files as they would back
+ * loop devices.
+ */
+
+#include <steps.h>
+#include <log.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/**
+ * Size of the target before deployment, smaller than the image.
+ */
+#define TARGET_SIZE (8 * 1024 * 1024)
+
+/**
+ * Size of the image, ending in an unaligned tail.
+ */
+#define IMAGE_SIZE (12 * 1024 * 1024 + 1000)
+
+/**
+ * Per-test fixture.
+ */
+struct Fixture {
+  char *dir;    ///< Temporary directory.
+  char *image;  ///< Path to the image.
+  char *target; ///< Path to the target.
+};
+
+/**
+ * Write `len` bytes of `c` at `off` in `path`.
+ */
+static void fill(const char *path, const off_t off, const size_t len, const int c)
+{
+  int fd = open(path, O_WRONLY | O_CREAT, 0644);
+  g_assert_cmpint(fd, >=, 0);
+
+  char *buf = g_malloc(len);
+  memset(buf, c, len);
+  g_assert_cmpint(pwrite(fd, buf, len, off), ==, len);
+
+  g_free(buf);
+  close(fd);
+}
+
+static void fixture_set_up(struct Fixture *f, gconstpointer data)
+{
+  (void)data;
+
+  f->dir = g_dir_make_tmp("libaoscdk-image-XXXXXX", NULL);
+  g_assert_nonnull(f->dir);
+
+  f->image = g_build_filename(f->dir, "image", NULL);
+  f->target = g_build_filename(f->dir, "target", NULL);
+
+  char *log = g_build_filename(f->dir, "log", NULL);
+  dk_log_init();
+  dk_log_set_output_file(log); // Errors must not turn into fatal criticals
+  g_free(log);
+}
+
+static void fixture_tear_down(struct Fixture *f, gconstpointer data)
+{
+  (void)data;
+
+  dk_log_deinit();
+
+  char *log = g_build_filename(f->dir, "log", NULL);
+  g_remove(log);
+  g_remove(f->image);
+  g_remove(f->target);
+  g_rmdir(f->dir);
+
+  g_free(log);
+  g_free(f->image);
+  g_free(f->target);
+  g_free(f->dir);
+}
+
+/**
+ * Data, an explicit zero chunk, a hole, and an unaligned tail are written onto
+ * a smaller target full of stale data. The target must end up identical to the
+ * image.
+ */
+static void test_regular_target(struct Fixture *f, gconstpointer data)
+{
+  (void)data;
+
+  fill(f->image, 0, 1024 * 1024, 'A');
+  fill(f->image, 4 * 1024 * 1024, 1024 * 1024, 0);
+  fill(f->image, IMAGE_SIZE - 1000, 1000, 'B');
+
+  fill(f->target, 0, TARGET_SIZE, 0xff);
+
+  g_assert_true(dk_step_image_deploy(f->image, f->target, NULL));
+
+  char *image = NULL, *target = NULL;
+  gsize image_len = 0, target_len = 0;
+
+  g_assert_true(g_file_get_contents(f->image, &image, &image_len, NULL));
+  g_assert_true(g_file_get_contents(f->target, &target, &target_len, NULL));
+
+  g_assert_cmpuint(image_len, ==, IMAGE_SIZE);
+  g_assert_cmpuint(target_len, ==, IMAGE_SIZE);
+  g_assert_true(memcmp(image, target, IMAGE_SIZE) == 0);
+
+  g_free(image);
+  g_free(target);
+}
+
+/**
+ * A larger target keeps its size, and stale data past the image is untouched.
+ */
+static void test_larger_target(struct Fixture *f, gconstpointer data)
+{
+  (void)data;
+
+  fill(f->image, 0, 4096, 'A');
+  fill(f->image, 2 * 1024 * 1024 - 1, 1, 0);
+
+  fill(f->target, 0, 4 * 1024 * 1024, 0xff);
+
+  g_assert_true(dk_step_image_deploy(f->image, f->target, NULL));
+
+  char *target = NULL;
+  gsize target_len = 0;
+
+  g_assert_true(g_file_get_contents(f->target, &target, &target_len, NULL));
+  g_assert_cmpuint(target_len, ==, 4 * 1024 * 1024);
+  g_assert_cmpint(target[0], ==, 'A');
+  g_assert_cmpint(target[4096], ==, 0);
+  g_assert_cmpint(target[2 * 1024 * 1024 - 1], ==, 0);
+  g_assert_cmpint((unsigned char)target[2 * 1024 * 1024], ==, 0xff);
+
+  g_free(target);
+}
+
+/**
+ * An ext4 image is grown to the size of the target.
+ */
+static void test_grow_ext4(struct Fixture *f, gconstpointer data)
+{
+  (void)data;
+
+  char *mkfs = g_find_program_in_path("mkfs.ext4");
+  char *e2fsck = g_find_program_in_path("e2fsck");
+  char *resize2fs = g_find_program_in_path("resize2fs");
+
+  if (!mkfs || !e2fsck || !resize2fs) {
+    g_test_skip("e2fsprogs is not available");
+    g_free(mkfs);
+    g_free(e2fsck);
+    g_free(resize2fs);
+    return;
+  }
+
+  char *argv[] = { mkfs, "-q", "-F", "-b", "4096", f->image, "16M", NULL };
+  int status = 0;
+  g_assert_true(g_spawn_sync(NULL, argv, NULL, G_SPAWN_STDOUT_TO_DEV_NULL | G_SPAWN_STDERR_TO_DEV_NULL, NULL, NULL, NULL, NULL, &status, NULL));
+  g_assert_cmpint(status, ==, 0);
+
+  fill(f->target, 0, 32 * 1024 * 1024, 0xff);
+
+  g_assert_true(dk_step_image_deploy(f->image, f->target, "ext4"));
+
+  // s_blocks_count_lo of the superblock at offset 1024, with 4 KiB blocks
+  int fd = open(f->target, O_RDONLY);
+  guint32 blocks = 0;
+  g_assert_cmpint(pread(fd, &blocks, sizeof(blocks), 1024 + 4), ==, sizeof(blocks));
+  close(fd);
+
+  g_assert_cmpuint(GUINT32_FROM_LE(blocks), ==, 32 * 1024 * 1024 / 4096);
+
+  g_free(mkfs);
+  g_free(e2fsck);
+  g_free(resize2fs);
+}
+
+/**
+ * Images that are not regular files have no meaningful size, and are rejected.
+ */
+static void test_reject_non_regular_image(struct Fixture *f, gconstpointer data)
+{
+  (void)data;
+
+  fill(f->target, 0, 4096, 0xff);
+
+  g_assert_false(dk_step_image_deploy("/dev/null", f->target, NULL));
+  g_assert_false(dk_step_image_deploy(f->dir, f->target, NULL));
+}
+
+int main(int argc, char **argv)
+{
+  g_test_init(&argc, &argv, NULL);
+
+  g_test_add("/image/regular-target", struct Fixture, NULL, fixture_set_up, test_regular_target, fixture_tear_down);
+  g_test_add("/image/larger-target", struct Fixture, NULL, fixture_set_up, test_larger_target, fixture_tear_down);
+  g_test_add("/image/grow-ext4", struct Fixture, NULL, fixture_set_up, test_grow_ext4, fixture_tear_down);
+  g_test_add("/image/reject-non-regular-image", struct Fixture, NULL, fixture_set_up, test_reject_non_regular_image, fixture_tear_down);
+
+  return g_test_run();
+}
@@ -0,0 +1,179 @@
+/**
+ * @file mem.c
+ * @author Junde Yhi <lmy441900@aosc.xyz>
+ * @copyright (C) 2019-2020 Anthon Open Source Community
+ *
+ * Tests of the memory budget.
+ */
+
+#include <mem.h>
+#include <glib.h>
+
+/**
+ * The budget set by the tests.
+ */
+#define BUDGET 1024
+
+/**
+ * Time given to a thread to return from dk_mem_acquire(), if it would, in
+ * microseconds.
+ */
+#define SETTLE_TIME (100 * 1000)
+
+/**
+ * Number of threads contending for the budget.
+ */
+#define NR_THREADS 8
+
+/**
+ * Number of requests made by each contending thread.
+ */
+#define NR_REQUESTS 20000
+
+/**
+ * Set once acquire_thread() has taken its memory.
+ */
+static gint acquired_g;
+
+static gpointer acquire_thread(gpointer data)
+{
+  dk_mem_acquire(DK_MEM_POOL_IO, GPOINTER_TO_INT(data));
+  g_atomic_int_set(&acquired_g, 1);
+
+  return NULL;
+}
+
+static gpointer contend_thread(gpointer data)
+{
+  enum DkMemPool pool = GPOINTER_TO_INT(data) % DK_MEM_POOL_MAX;
+
+  for (int i = 0; i < NR_REQUESTS; i++) {
+    size_t size = 1 + (i * 37) % BUDGET;
+
+    dk_mem_acquire(pool, size);
+    dk_mem_release(pool, size);
+  }
+
+  return NULL;
+}
+
+/**
+ * Without a budget, everything is granted.
+ */
+static void test_unlimited(void)
+{
+  g_assert_cmpuint(dk_mem_get_budget(), ==, 0);
+
+  g_assert_true(dk_mem_try_acquire(DK_MEM_POOL_IO, G_MAXSIZE / 4));
+  g_assert_true(dk_mem_try_acquire(DK_MEM_POOL_IO, G_MAXSIZE / 4));
+
+  dk_mem_release(DK_MEM_POOL_IO, G_MAXSIZE / 4);
+  dk_mem_release(DK_MEM_POOL_IO, G_MAXSIZE / 4);
+}
+
+/**
+ * A full pool refuses more, while an empty pool is granted anything.
+ */
+static void test_full(void)
+{
+  dk_mem_set_budget(BUDGET);
+  g_assert_cmpuint(dk_mem_get_budget(), ==, BUDGET);
+
+  dk_mem_acquire(DK_MEM_POOL_IO, BUDGET);
+  g_assert_false(dk_mem_try_acquire(DK_MEM_POOL_IO, 1));
+
+  g_assert_true(dk_mem_try_acquire(DK_MEM_POOL_WRITE, 4 * BUDGET));
+  g_assert_false(dk_mem_try_acquire(DK_MEM_POOL_WRITE, 1));
+  dk_mem_release(DK_MEM_POOL_WRITE, 4 * BUDGET);
+
+  dk_mem_release(DK_MEM_POOL_IO, BUDGET);
+  g_assert_true(dk_mem_try_acquire(DK_MEM_POOL_IO, 1));
+  dk_mem_release(DK_MEM_POOL_IO, 1);
+
+  dk_mem_set_budget(0);
+}
+
+/**
+ * A blocked request returns once memory of its pool is released.
+ */
+static void test_wait_release(void)
+{
+  dk_mem_set_budget(BUDGET);
+  g_atomic_int_set(&acquired_g, 0);
+
+  dk_mem_acquire(DK_MEM_POOL_IO, BUDGET);
+
+  GThread *thread = g_thread_new("acquire", acquire_thread, GINT_TO_POINTER(BUDGET / 2));
+
+  g_usleep(SETTLE_TIME);
+  g_assert_cmpint(g_atomic_int_get(&acquired_g), ==, 0);
+
+  dk_mem_release(DK_MEM_POOL_IO, BUDGET);
+  g_thread_join(thread);
+  g_assert_cmpint(g_atomic_int_get(&acquired_g), ==, 1);
+
+  dk_mem_release(DK_MEM_POOL_IO, BUDGET / 2);
+  dk_mem_set_budget(0);
+}
+
+/**
+ * A blocked request returns once the budget is raised.
+ */
+static void test_wait_budget(void)
+{
+  dk_mem_set_budget(BUDGET);
+  g_atomic_int_set(&acquired_g, 0);
+
+  dk_mem_acquire(DK_MEM_POOL_IO, BUDGET);
+
+  GThread *thread = g_thread_new("acquire", acquire_thread, GINT_TO_POINTER(BUDGET));
+
+  g_usleep(SETTLE_TIME);
+  g_assert_cmpint(g_atomic_int_get(&acquired_g), ==, 0);
+
+  dk_mem_set_budget(2 * BUDGET);
+  g_thread_join(thread);
+  g_assert_cmpint(g_atomic_int_get(&acquired_g), ==, 1);
+
+  dk_mem_release(DK_MEM_POOL_IO, 2 * BUDGET);
+  dk_mem_set_budget(0);
+}
+
+/**
+ * Threads of all pools contending for a small budget all get through, and
+ * give everything back.
+ */
+static void test_contention(void)
+{
+  GThread *threads[NR_THREADS];
+
+  dk_mem_set_budget(BUDGET);
+
+  for (int i = 0; i < NR_THREADS; i++)
+    threads[i] = g_thread_new("contend", contend_thread, GINT_TO_POINTER(i));
+
+  for (int i = 0; i < NR_THREADS; i++)
+    g_thread_join(threads[i]);
+
+  // Everything is back, so the whole budget fits again
+  for (int i = 0; i < DK_MEM_POOL_MAX; i++) {
+    dk_mem_acquire(i, 1);
+    g_assert_true(dk_mem_try_acquire(i, BUDGET - 1));
+    dk_mem_release(i, BUDGET);
+  }
+
+  dk_mem_set_budget(0);
+}
+
+int main(int argc, char **argv)
+{
+  g_test_init(&argc, &argv, NULL);
+
+  g_test_add_func("/mem/unlimited", test_unlimited);
+  g_test_add_func("/mem/full", test_full);
+  g_test_add_func("/mem/wait-release", test_wait_release);
+  g_test_add_func("/mem/wait-budget", test_wait_budget);
+  g_test_add_func("/mem/contention", test_contention);
+
+  return g_test_run();
+}
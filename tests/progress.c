@@ -0,0 +1,165 @@
+/**
+ * @file progress.c
+ * @author Junde Yhi <lmy441900@aosc.xyz>
+ * @copyright (C) 2019-2020 Anthon Open Source Community
+ *
+ * Tests of the progress counters. Only what does not depend on timing is
+ * checked; the throughput and the ETA are left alone.
+ */
+
+#include <progress.h>
+#include <glib.h>
+
+/**
+ * Number of threads adding to the counters at once, more than the shards.
+ */
+#define NR_THREADS 32
+
+/**
+ * Number of additions done by each thread.
+ */
+#define NR_ADDS 10000
+
+/**
+ * Take a sample.
+ *
+ * @return A #GVariant to unref.
+ */
+static GVariant *sample(void)
+{
+  return g_variant_ref_sink(dk_progress_sample());
+}
+
+/**
+ * Look up an unsigned counter in a sample.
+ */
+static guint64 lookup_uint64(GVariant *s, const char *key)
+{
+  guint64 value = 0;
+
+  g_assert_true(g_variant_lookup(s, key, "t", &value));
+  return value;
+}
+
+/**
+ * Look up the percentage in a sample.
+ */
+static gint32 lookup_percent(GVariant *s)
+{
+  gint32 percent = -1;
+
+  g_assert_true(g_variant_lookup(s, "percent", "i", &percent));
+  return percent;
+}
+
+static gpointer add_thread(gpointer data)
+{
+  (void)data;
+
+  for (int i = 0; i < NR_ADDS; i++)
+    dk_progress_add(3, 1);
+
+  return NULL;
+}
+
+/**
+ * Without totals, neither the percentage nor the ETA can be told.
+ */
+static void test_unknown_totals(void)
+{
+  dk_progress_reset(0, 0);
+  dk_progress_add(100, 1);
+
+  GVariant *s = sample();
+
+  g_assert_cmpuint(lookup_uint64(s, "bytes"), ==, 100);
+  g_assert_cmpuint(lookup_uint64(s, "items"), ==, 1);
+  g_assert_null(g_variant_lookup_value(s, "bytes_total", NULL));
+  g_assert_null(g_variant_lookup_value(s, "items_total", NULL));
+  g_assert_null(g_variant_lookup_value(s, "percent", NULL));
+  g_assert_null(g_variant_lookup_value(s, "eta", NULL));
+
+  g_variant_unref(s);
+}
+
+/**
+ * The percentage follows bytes if their total is known, and items otherwise.
+ */
+static void test_percent(void)
+{
+  dk_progress_reset(1000, 10);
+  dk_progress_add(250, 5);
+
+  GVariant *s = sample();
+  g_assert_cmpuint(lookup_uint64(s, "bytes_total"), ==, 1000);
+  g_assert_cmpuint(lookup_uint64(s, "items_total"), ==, 10);
+  g_assert_cmpint(lookup_percent(s), ==, 25);
+  g_variant_unref(s);
+
+  dk_progress_reset(0, 4);
+  dk_progress_add(250, 1);
+
+  s = sample();
+  g_assert_cmpint(lookup_percent(s), ==, 25);
+  g_variant_unref(s);
+}
+
+/**
+ * Processing more than announced caps the percentage at 100, and leaves
+ * nothing to wait for.
+ */
+static void test_percent_capped(void)
+{
+  dk_progress_reset(100, 0);
+  dk_progress_add(250, 0);
+
+  GVariant *s = sample();
+  gint64 eta = -1;
+
+  g_assert_cmpint(lookup_percent(s), ==, 100);
+  if (g_variant_lookup(s, "eta", "x", &eta))
+    g_assert_cmpint(eta, ==, 0);
+
+  g_variant_unref(s);
+}
+
+/**
+ * Additions from many threads, spread over the shards, are all summed up, and
+ * all cleared by a reset.
+ */
+static void test_threads(void)
+{
+  GThread *threads[NR_THREADS];
+
+  dk_progress_reset(0, 0);
+
+  for (int i = 0; i < NR_THREADS; i++)
+    threads[i] = g_thread_new("progress", add_thread, NULL);
+
+  for (int i = 0; i < NR_THREADS; i++)
+    g_thread_join(threads[i]);
+
+  GVariant *s = sample();
+  g_assert_cmpuint(lookup_uint64(s, "bytes"), ==, 3 * NR_THREADS * NR_ADDS);
+  g_assert_cmpuint(lookup_uint64(s, "items"), ==, NR_THREADS * NR_ADDS);
+  g_variant_unref(s);
+
+  dk_progress_reset(0, 0);
+
+  s = sample();
+  g_assert_cmpuint(lookup_uint64(s, "bytes"), ==, 0);
+  g_assert_cmpuint(lookup_uint64(s, "items"), ==, 0);
+  g_variant_unref(s);
+}
+
+int main(int argc, char **argv)
+{
+  g_test_init(&argc, &argv, NULL);
+
+  g_test_add_func("/progress/unknown-totals", test_unknown_totals);
+  g_test_add_func("/progress/percent", test_percent);
+  g_test_add_func("/progress/percent-capped", test_percent_capped);
+  g_test_add_func("/progress/threads", test_threads);
+
+  return g_test_run();
+}
@@ -0,0 +1,240 @@
+/**
+ * @file writer.c
+ * @author Junde Yhi <lmy441900@aosc.xyz>
+ * @copyright (C) 2019-2020 Anthon Open Source Community
+ *
+ * Tests of the batching file writer, run against each backend.
+ */
+
+#include <writer.h>
+#include <log.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/**
+ * Number of files written at once, more than a batch of the writer.
+ */
+#define NR_FILES 200
+
+/**
+ * Per-test fixture.
+ */
+struct Fixture {
+  char *dir;                ///< Temporary directory the files are written into.
+  int dirfd;                ///< Descriptor of Fixture::dir.
+  struct DkWriter *writer;  ///< The writer under test, or `NULL` if unsupported.
+};
+
+/**
+ * Check that `path` in `f` holds `len` bytes of `data` and has `mode`.
+ */
+static void check_file(struct Fixture *f, const char *path, const void *data, const size_t len, const mode_t mode)
+{
+  char *full = g_build_filename(f->dir, path, NULL);
+  char *content = NULL;
+  gsize content_len = 0;
+  GStatBuf st;
+
+  g_assert_true(g_file_get_contents(full, &content, &content_len, NULL));
+  g_assert_cmpuint(content_len, ==, len);
+  g_assert_true(len == 0 || memcmp(content, data, len) == 0);
+
+  g_assert_cmpint(g_stat(full, &st), ==, 0);
+  g_assert_cmpint(st.st_mode & 07777, ==, mode);
+
+  g_free(content);
+  g_free(full);
+}
+
+static void fixture_set_up(struct Fixture *f, gconstpointer data)
+{
+  f->dir = g_dir_make_tmp("libaoscdk-writer-XXXXXX", NULL);
+  g_assert_nonnull(f->dir);
+
+  f->dirfd = open(f->dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  g_assert_cmpint(f->dirfd, >=, 0);
+
+  char *log = g_build_filename(f->dir, "log", NULL);
+  dk_log_init();
+  dk_log_set_output_file(log); // Errors must not turn into fatal criticals
+  g_free(log);
+
+  f->writer = dk_writer_new_with_backend(GPOINTER_TO_INT(data));
+}
+
+static void fixture_tear_down(struct Fixture *f, gconstpointer data)
+{
+  (void)data;
+
+  if (f->writer)
+    dk_writer_free(f->writer);
+
+  dk_log_deinit();
+
+  // Everything written is flat in the directory
+  GDir *dir = g_dir_open(f->dir, 0, NULL);
+  const char *name = NULL;
+
+  while ((name = g_dir_read_name(dir)))
+    unlinkat(f->dirfd, name, 0);
+
+  g_dir_close(dir);
+  close(f->dirfd);
+  g_rmdir(f->dir);
+  g_free(f->dir);
+}
+
+/**
+ * Skip the test if the backend is not supported here.
+ *
+ * @return `TRUE` if the test is skipped.
+ */
+static gboolean skip_unsupported(struct Fixture *f)
+{
+  if (f->writer)
+    return FALSE;
+
+  g_test_skip("The backend is not supported");
+  return TRUE;
+}
+
+/**
+ * Files of different contents, spanning several batches, are all written.
+ */
+static void test_contents(struct Fixture *f, gconstpointer data)
+{
+  (void)data;
+
+  if (skip_unsupported(f))
+    return;
+
+  for (int i = 0; i < NR_FILES; i++) {
+    char path[32], content[64];
+    g_snprintf(path, sizeof(path), "file-%d", i);
+    g_snprintf(content, sizeof(content), "content of file %d", i);
+
+    g_assert_true(dk_writer_add(f->writer, f->dirfd, path, content, strlen(content), 0644));
+  }
+
+  g_assert_true(dk_writer_flush(f->writer));
+
+  for (int i = 0; i < NR_FILES; i++) {
+    char path[32], content[64];
+    g_snprintf(path, sizeof(path), "file-%d", i);
+    g_snprintf(content, sizeof(content), "content of file %d", i);
+
+    check_file(f, path, content, strlen(content), 0644);
+  }
+}
+
+/**
+ * Zero-length files are created, and truncate existing files.
+ */
+static void test_empty(struct Fixture *f, gconstpointer data)
+{
+  (void)data;
+
+  if (skip_unsupported(f))
+    return;
+
+  char *existing = g_build_filename(f->dir, "existing", NULL);
+  g_assert_true(g_file_set_contents(existing, "stale", -1, NULL));
+  g_free(existing);
+
+  g_assert_true(dk_writer_add(f->writer, f->dirfd, "empty", NULL, 0, 0644));
+  g_assert_true(dk_writer_add(f->writer, f->dirfd, "existing", NULL, 0, 0644));
+  g_assert_true(dk_writer_flush(f->writer));
+
+  check_file(f, "empty", NULL, 0, 0644);
+  check_file(f, "existing", NULL, 0, 0644);
+}
+
+/**
+ * The mode is applied to files that exist with another mode, and regardless of
+ * the umask.
+ */
+static void test_mode(struct Fixture *f, gconstpointer data)
+{
+  (void)data;
+
+  if (skip_unsupported(f))
+    return;
+
+  char *existing = g_build_filename(f->dir, "existing", NULL);
+  g_assert_true(g_file_set_contents(existing, "a longer stale content", -1, NULL));
+  g_assert_cmpint(g_chmod(existing, 0600), ==, 0);
+  g_free(existing);
+
+  mode_t mask = umask(022);
+
+  g_assert_true(dk_writer_add(f->writer, f->dirfd, "existing", "new", 3, 0644));
+  g_assert_true(dk_writer_add(f->writer, f->dirfd, "writable", "new", 3, 0666));
+  g_assert_true(dk_writer_flush(f->writer));
+
+  umask(mask);
+
+  check_file(f, "existing", "new", 3, 0644);
+  check_file(f, "writable", "new", 3, 0666);
+}
+
+/**
+ * A file that cannot be created fails the flush, but the other files of the
+ * batch are still written.
+ */
+static void test_missing_parent(struct Fixture *f, gconstpointer data)
+{
+  (void)data;
+
+  if (skip_unsupported(f))
+    return;
+
+  g_assert_true(dk_writer_add(f->writer, f->dirfd, "before", "before", 6, 0644));
+  g_assert_true(dk_writer_add(f->writer, f->dirfd, "missing/file", "missing", 7, 0644));
+  g_assert_true(dk_writer_add(f->writer, f->dirfd, "after", "after", 5, 0644));
+  g_assert_false(dk_writer_flush(f->writer));
+
+  check_file(f, "before", "before", 6, 0644);
+  check_file(f, "after", "after", 5, 0644);
+
+  // The writer is still usable afterwards
+  g_assert_true(dk_writer_add(f->writer, f->dirfd, "again", "again", 5, 0644));
+  g_assert_true(dk_writer_flush(f->writer));
+
+  check_file(f, "again", "again", 5, 0644);
+}
+
+/**
+ * Register a test against every backend.
+ */
+static void add_test(const char *name, void (*test)(struct Fixture *, gconstpointer))
+{
+  const struct {
+    const char *name;
+    enum DkWriterBackend backend;
+  } backends[] = {
+    { "sync", DK_WRITER_BACKEND_SYNC },
+    { "io_uring", DK_WRITER_BACKEND_IO_URING },
+  };
+
+  for (size_t i = 0; i < G_N_ELEMENTS(backends); i++) {
+    char *path = g_strdup_printf("/writer/%s/%s", backends[i].name, name);
+    g_test_add(path, struct Fixture, GINT_TO_POINTER(backends[i].backend), fixture_set_up, test, fixture_tear_down);
+    g_free(path);
+  }
+}
+
+int main(int argc, char **argv)
+{
+  g_test_init(&argc, &argv, NULL);
+
+  add_test("contents", test_contents);
+  add_test("empty", test_empty);
+  add_test("mode", test_mode);
+  add_test("missing-parent", test_missing_parent);
+
+  return g_test_run();
+}
@@ -6,7 +6,55 @@
  * An executable for invoking libaoscdk functionalities.
  */
 
+#include <libaoscdk.h>
+#include <glib.h>
+#include <stdio.h>
+
+/**
+ * Memory budget in MiB given by `--memory-budget`, or 0 for no limit.
+ */
+static gint64 memory_budget_mib_g = 0;
+
+/**
+ * Command line options.
+ */
+static GOptionEntry options_g[] = {
+  { "memory-budget", 'm', 0, G_OPTION_ARG_INT64, &memory_budget_mib_g, "Limit memory used for buffering to MIB MiB (0 for no limit)", "MIB" },
+  { NULL }
+};
+
 int main(int argc, char **argv)
 {
+  GError *error = NULL;
+  GOptionContext *context = g_option_context_new(NULL);
+
+  g_option_context_add_main_entries(context, options_g, NULL);
+
+  if (!g_option_context_parse(context, &argc, &argv, &error)) {
+    fprintf(stderr, "%s\n", error->message);
+    g_clear_error(&error);
+    g_option_context_free(context);
+    return 1;
+  }
+
+  g_option_context_free(context);
+
+  if (memory_budget_mib_g < 0) {
+    fprintf(stderr, "Memory budget must not be negative\n");
+    return 1;
+  }
+
+  if ((guint64)memory_budget_mib_g > G_MAXSIZE / (1024 * 1024)) {
+    fprintf(stderr, "Memory budget is too large\n");
+    return 1;
+  }
+
+  dk_log_init();
+  dk_mem_set_budget((size_t)memory_budget_mib_g * 1024 * 1024);
+
+  // This is where an installation ends
+  dk_mem_report();
+  dk_log_deinit();
+
   return 0;
 }